@@ -3,7 +3,15 @@
 #include <string.h>
 #include <math.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 
 #include <libusb.h>
 
@@ -26,6 +34,9 @@ static int lua_absindex(lua_State *L, int index)
 	   ? lua_gettop(L) + index + 1
 	   : index;
 }
+#define l_resume(L,from,n)	lua_resume(L,(n))
+#else
+#define l_resume(L,from,n)	lua_resume(L,(from),(n))
 #endif
 
 static lua_Unsigned l_checkunsigned(lua_State *L, int narg, int nval)
@@ -122,13 +133,29 @@ struct usb_hid_descriptor
 #define DEVICE_MT	"libusb1_device"
 #define HANDLE_MT	"libusb1_device_handle"
 #define TRANSFER_MT	"libusb1_transfer"
+#define BUFFER_MT	"libusb1_buffer"
+#define STREAM_MT	"libusb1_stream"
+#define DEVDESC_MT	"libusb1_device_descriptor"
+#define CONFIGDESC_MT	"libusb1_config_descriptor"
+#define IFACEDESC_MT	"libusb1_interface_descriptor"
+#define ENDPDESC_MT	"libusb1_endpoint_descriptor"
 #define DEFAULT_CTX	"libusb1 default context"
 #define DEVICES_REG	"libusb1 devices"
 #define DEVPTR_REG	"libusb1 pointers"
 #define HANDLES_REG	"libusb1 handles"
 #define TRANSFER_REG	"libusb1 active transfers"
 #define BUFFER_REG	"libusb1 transfer buffers"
+#define CALLBACK_REG	"libusb1 transfer callbacks"
 #define POLLFD_REG	"libusb1 pollfds"
+#define VIEWS_REG	"libusb1 buffer views"
+#define MAINTHREAD_REG	"libusb1 main thread"
+#define HOTPLUG_REG	"libusb1 hotplug callbacks"
+#define CONTEXTS_REG	"libusb1 contexts"
+#define ATTACHED_REG	"libusb1 attached devices"
+#define CHANGES_REG	"libusb1 device snapshots"
+#define DESC_REG	"libusb1 descriptor cache"
+#define DESCOWNER_REG	"libusb1 descriptor owners"
+#define STRINGS_REG	"libusb1 string cache"
 
 /* NULL is a valid context */
 #define INVALID_CONTEXT	((libusb_context*)1)
@@ -136,6 +163,148 @@ struct usb_hid_descriptor
 #define INVALID_HANDLE	((libusb_device_handle*)0)
 #define INVALID_TRANSFER ((struct libusb_transfer*)0)
 
+/* lock-free queue primitives */
+#define l_atomic_xchg(p,v)	__atomic_exchange_n((p),(v),__ATOMIC_ACQ_REL)
+#define l_atomic_load(p)	__atomic_load_n((p),__ATOMIC_ACQUIRE)
+#define l_atomic_store(p,v)	__atomic_store_n((p),(v),__ATOMIC_RELEASE)
+#define l_atomic_add(p,v)	__atomic_add_fetch((p),(v),__ATOMIC_ACQ_REL)
+#define l_atomic_cas(p,e,v)	__atomic_compare_exchange_n((p),(e),(v),1, \
+				    __ATOMIC_ACQ_REL,__ATOMIC_ACQUIRE)
+
+/* completion waiting to be dispatched on the Lua thread */
+struct lusb_event
+{
+    struct lusb_event *next;
+    void (*dispatch)(lua_State *L, struct lusb_event *ev);
+    void (*discard)(lua_State *L, struct lusb_event *ev);	/* at exit */
+};
+
+/* transfer outcomes and throughput, updated from any thread */
+struct lusb_counters
+{
+    unsigned long long bytes_in;
+    unsigned long long bytes_out;
+    unsigned long long completed;
+    unsigned long long timeouts;
+    unsigned long long stalls;
+    unsigned long long overflows;
+    unsigned long long cancelled;
+    unsigned long long no_device;
+    unsigned long long errors;
+};
+
+struct lusb_hotplug_cb;
+
+/* the context pointer must come first */
+struct lusb_context_ud
+{
+    libusb_context *ctx;
+    pthread_t thread;
+    int threaded;	/* completions go through the queue */
+    int stop;
+    int evfd[2];	/* notifier read and write ends, -1 when unused */
+    /* intrusive MPSC queue, pushed by any thread, popped by Lua */
+    struct lusb_event *head;
+    struct lusb_event *tail;
+    struct lusb_event stub;
+    struct lusb_event *held;	/* popped ahead of time, Lua thread only */
+    struct lusb_event **heldtail;
+    struct lusb_counters counters;	/* totals of all its handles */
+    struct lusb_hotplug_cb *hotplug;	/* live registrations */
+};
+
+static double monotime(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* transfer flags, not the same as libusb_transfer.flags */
+#define TRANSFER_REUSE_BUFFER	0x01
+#define TRANSFER_NATIVE_BUFFER	0x02	/* malloc'd, not in BUFFER_REG */
+
+/* the libusb_transfer.flags that Lua may set */
+#define TRANSFER_LUA_FLAGS	(LIBUSB_TRANSFER_SHORT_NOT_OK|LIBUSB_TRANSFER_ADD_ZERO_PACKET)
+
+#define LATENCY_BUCKETS	32
+/* endpoint address to 0..ENDPOINT_SLOTS-1, IN endpoints in the upper half */
+#define ENDPOINT_SLOTS	32
+#define EPINDEX(ep)	(((ep) & 0x0f) | (((ep) & 0x80) >> 3))
+#define EPADDRESS(i)	(((i) & 0x0f) | (((i) & 0x10) << 3))
+
+/* completion latencies in microseconds, bucket b counts [2^(b-1), 2^b) */
+struct lusb_latency
+{
+    unsigned int bucket[LATENCY_BUCKETS];
+    unsigned int count;
+    unsigned int min;
+    unsigned int max;
+    unsigned long long sum;
+};
+
+/* the handle pointer must come first */
+struct lusb_handle_ud
+{
+    libusb_device_handle *handle;
+    struct lusb_context_ud *ctx;	/* kept alive by HANDLES_REG, may be NULL */
+    libusb_device_handle *closed;	/* close() waiting for the users */
+    int users;	/* stream rings that still have transfers, dev-mem maps */
+    struct lusb_counters total;
+    struct lusb_counters counters[ENDPOINT_SLOTS];
+    struct lusb_latency latency[ENDPOINT_SLOTS];
+};
+
+/* the transfer pointer must come first */
+struct lusb_transfer_ud
+{
+    struct libusb_transfer *tx;
+    int flags;
+    unsigned char *cbuf;	/* TRANSFER_NATIVE_BUFFER storage */
+    size_t csize;
+    int active;
+    double submitted;	/* monotime() of the last submit */
+    double completed;	/* and of its completion */
+    struct lusb_handle_ud *handle;	/* set when filled, for statistics */
+};
+
+struct lusb_stream;
+
+struct lusb_stream_slot
+{
+    struct libusb_transfer *tx;
+    struct lusb_stream *stream;
+    int busy;
+};
+
+/* ring of transfers that is kept in flight from C */
+struct lusb_stream
+{
+    libusb_context *ctx;
+    struct lusb_stream_slot *slots;
+    unsigned char *memory;
+    int *ready;		/* completed slots waiting to be read */
+    int depth, head, count;
+    int packets;	/* iso packets per transfer, 0 for bulk */
+    int packetsize;
+    int active;		/* transfers in flight */
+    int error;		/* stops resubmitting */
+    int completed;	/* for libusb_handle_events_completed */
+    int closing;
+    int orphaned;	/* draining failed, free when idle */
+    struct lusb_handle_ud *handle;	/* in use until drained */
+    pthread_mutex_t lock;	/* completions may run on the event thread */
+};
+
+/* byte buffer, either owns the memory after it or is a view of another */
+struct lusb_buffer
+{
+    unsigned char *data;
+    size_t length;
+    /* set when data came from libusb_dev_mem_alloc */
+    struct lusb_handle_ud *devmem;
+};
+
 
 static int _err(lua_State *L, int err)
 {
@@ -180,14 +349,240 @@ static int _err(lua_State *L, int err)
     return 3;
 }
 
+static int statuserr(int status)
+{
+    switch (status)
+    {
+	case LIBUSB_TRANSFER_COMPLETED:
+	    return LIBUSB_SUCCESS;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+	    return LIBUSB_ERROR_TIMEOUT;
+	case LIBUSB_TRANSFER_CANCELLED:
+	    return LIBUSB_ERROR_INTERRUPTED;
+	case LIBUSB_TRANSFER_STALL:
+	    return LIBUSB_ERROR_PIPE;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+	    return LIBUSB_ERROR_NO_DEVICE;
+	case LIBUSB_TRANSFER_OVERFLOW:
+	    return LIBUSB_ERROR_OVERFLOW;
+	default:
+	    return LIBUSB_ERROR_IO;
+    }
+}
+
 static libusb_context** newctx(lua_State *L)
 {
-    libusb_context **ctx;
-    ctx = (libusb_context**)lua_newuserdata(L, sizeof(libusb_context*));
-    *ctx = INVALID_CONTEXT;
+    struct lusb_context_ud *ud;
+    ud = (struct lusb_context_ud*)lua_newuserdata(L, sizeof(struct lusb_context_ud));
+    memset(ud, 0, sizeof(struct lusb_context_ud));
+    ud->ctx = INVALID_CONTEXT;
+    ud->head = ud->tail = &ud->stub;
+    ud->heldtail = &ud->held;
+    ud->evfd[0] = ud->evfd[1] = -1;
     luaL_getmetatable(L, CONTEXT_MT);
     lua_setmetatable(L, -2);
-    return ctx;
+    return &ud->ctx;
+}
+
+static void pushevent(struct lusb_context_ud *ud, struct lusb_event *ev)
+{
+    struct lusb_event *prev;
+    l_atomic_store(&ev->next, NULL);
+    prev = l_atomic_xchg(&ud->head, ev);
+    l_atomic_store(&prev->next, ev);
+}
+
+/* only called from the Lua thread */
+static struct lusb_event* popevent(struct lusb_context_ud *ud)
+{
+    struct lusb_event *tail = ud->tail;
+    struct lusb_event *next = l_atomic_load(&tail->next);
+    if (tail == &ud->stub)
+    {
+	if (next == NULL)
+	    return NULL;
+	ud->tail = tail = next;
+	next = l_atomic_load(&tail->next);
+    }
+    if (next != NULL)
+    {
+	ud->tail = next;
+	return tail;
+    }
+    /* a producer is between the exchange and the link */
+    if (tail != l_atomic_load(&ud->head))
+	return NULL;
+    pushevent(ud, &ud->stub);
+    next = l_atomic_load(&tail->next);
+    if (next != NULL)
+    {
+	ud->tail = next;
+	return tail;
+    }
+    return NULL;
+}
+
+/* makes the notifier readable, from any thread */
+static void notify(struct lusb_context_ud *ud)
+{
+    ssize_t n;
+    if (ud->evfd[1] >= 0)
+    {
+#ifdef __linux__
+	uint64_t one = 1;
+	n = write(ud->evfd[1], &one, sizeof(one));
+#else
+	char one = 1;
+	n = write(ud->evfd[1], &one, 1);
+#endif
+	(void)n;
+    }
+}
+
+static void postevent(struct lusb_context_ud *ud, struct lusb_event *ev)
+{
+    pushevent(ud, ev);
+    notify(ud);
+}
+
+/* reset the notifier, it is non-blocking */
+static void drainnotifier(struct lusb_context_ud *ud)
+{
+    char buf[64];
+    if (ud->evfd[0] >= 0)
+	while (read(ud->evfd[0], buf, sizeof(buf)) > 0)
+	    ;
+}
+
+static void closenotifier(struct lusb_context_ud *ud)
+{
+    if (ud->evfd[0] >= 0)
+    {
+	close(ud->evfd[0]);
+	if (ud->evfd[1] != ud->evfd[0])
+	    close(ud->evfd[1]);
+	ud->evfd[0] = ud->evfd[1] = -1;
+    }
+}
+
+static int opennotifier(struct lusb_context_ud *ud)
+{
+#ifdef __linux__
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0)
+	return LIBUSB_ERROR_OTHER;
+    ud->evfd[0] = ud->evfd[1] = fd;
+#else
+    int fd[2], i;
+    if (pipe(fd) != 0)
+	return LIBUSB_ERROR_OTHER;
+    for (i = 0; i < 2; ++i)
+    {
+	fcntl(fd[i], F_SETFL, fcntl(fd[i], F_GETFL) | O_NONBLOCK);
+	fcntl(fd[i], F_SETFD, FD_CLOEXEC);
+    }
+    ud->evfd[0] = fd[0];
+    ud->evfd[1] = fd[1];
+#endif
+    return 0;
+}
+
+static void* lusb_event_thread_fn(void *arg)
+{
+    struct lusb_context_ud *ud = (struct lusb_context_ud*)arg;
+    struct timeval tv;
+    while (!l_atomic_load(&ud->stop))
+    {
+	tv.tv_sec = 0;
+	tv.tv_usec = 100000;
+	libusb_handle_events_timeout_completed(ud->ctx, &tv, &ud->stop);
+    }
+    return NULL;
+}
+
+static void stopthread(struct lusb_context_ud *ud)
+{
+    if (ud->threaded)
+    {
+	l_atomic_store(&ud->stop, 1);
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+	libusb_interrupt_event_handler(ud->ctx);
+#endif
+	pthread_join(ud->thread, NULL);
+	ud->threaded = 0;
+    }
+}
+
+static int startthread(struct lusb_context_ud *ud)
+{
+    if (!ud->threaded)
+    {
+	ud->stop = 0;
+	ud->threaded = 1;
+	if (pthread_create(&ud->thread, NULL, lusb_event_thread_fn, ud) != 0)
+	{
+	    ud->threaded = 0;
+	    return LIBUSB_ERROR_OTHER;
+	}
+    }
+    return 0;
+}
+
+/* held events keep their place ahead of the queue */
+static struct lusb_event* nextevent(struct lusb_context_ud *ud)
+{
+    struct lusb_event *ev = ud->held;
+    if (ev == NULL)
+	return popevent(ud);
+    if ((ud->held = ev->next) == NULL)
+	ud->heldtail = &ud->held;
+    return ev;
+}
+
+/*
+ * Pops events until ev, which the caller knows is queued, and holds
+ * the ones before it for the next dispatch.
+ */
+static void takeevent(struct lusb_context_ud *ud, struct lusb_event *ev)
+{
+    struct lusb_event *e, **p;
+    for (p = &ud->held; *p != NULL; p = &(*p)->next)
+	if (*p == ev)
+	{
+	    if ((*p = ev->next) == NULL)
+		ud->heldtail = p;
+	    return;
+	}
+    /* a producer may still be linking it in, the window is short */
+    while ((e = popevent(ud)) != ev)
+	if (e != NULL)
+	{
+	    e->next = NULL;
+	    *ud->heldtail = e;
+	    ud->heldtail = &e->next;
+	}
+}
+
+/* run the callbacks of queued completions, at most max of them */
+static int dispatchevents(lua_State *L, struct lusb_context_ud *ud, int max)
+{
+    struct lusb_event *ev;
+    int n;
+    for (n = 0; max <= 0 || n < max; ++n)
+    {
+	if ((ev = nextevent(ud)) == NULL)
+	    break;
+	ev->dispatch(L, ev);
+    }
+    return n;
+}
+
+/* releases what is still queued when the context goes away */
+static void discardevents(lua_State *L, struct lusb_context_ud *ud)
+{
+    struct lusb_event *ev;
+    while ((ev = nextevent(ud)) != NULL)
+	ev->discard(L, ev);
 }
 
 static void ctxptr(lua_State *L, int ctx, libusb_context *ptr)
@@ -277,36 +672,57 @@ static libusb_device** newdev(lua_State *L, int object, libusb_device *dev)
 	lua_getfield(L, LUA_REGISTRYINDEX, HANDLES_REG);
 	lua_pushvalue(L, object);
 	lua_rawget(L, -2);
+	lua_remove(L, -2);
     }
     else
     {
 	lua_pop(L, 2);
 	lua_pushvalue(L, object);
     }
-    lua_getmetatable(L, -1);
-    luaL_getmetatable(L, CONTEXT_MT);
-    if (lua_rawequal(L, -1, -2))
+    if (lua_getmetatable(L, -1))
     {
+	luaL_getmetatable(L, CONTEXT_MT);
+	if (lua_rawequal(L, -1, -2))
+	{
+	    lua_pop(L, 2);
+	    lua_getfield(L, LUA_REGISTRYINDEX, DEVICES_REG);
+	    lua_insert(L, -3);
+	    lua_rawset(L, -3);
+	    lua_pop(L, 1);
+	    return udev;
+	}
 	lua_pop(L, 2);
-	lua_getfield(L, LUA_REGISTRYINDEX, DEVICES_REG);
-	lua_insert(L, -3);
-	lua_rawset(L, -3);
-	lua_pop(L, 1);
-    }
-    else
-    {
-	/* not a context object, ignore it */
-	lua_pop(L, 4);
     }
+    /* not a context object, ignore it */
+    lua_pop(L, 2);
     return udev;
 }
 
+/* min and max go first: a completion that counts after the reset then
+ * also sees the reset extremes, see recordlatency */
+static void resetlatency(struct lusb_latency *lat)
+{
+    int i;
+    l_atomic_store(&lat->min, 0xffffffffu);
+    l_atomic_store(&lat->max, 0);
+    for (i = 0; i < LATENCY_BUCKETS; ++i)
+	l_atomic_store(&lat->bucket[i], 0);
+    l_atomic_store(&lat->count, 0);
+    l_atomic_store(&lat->sum, 0);
+}
+
 static libusb_device_handle** newhandle(lua_State *L, int object)
 {
     libusb_device_handle **handle;
+    struct lusb_handle_ud *ud;
+    int i;
     object = lua_absindex(L, object);
-    handle = (libusb_device_handle**)lua_newuserdata(L, sizeof(libusb_device_handle*));
+    ud = (struct lusb_handle_ud*)lua_newuserdata(L, sizeof(struct lusb_handle_ud));
+    memset(ud, 0, sizeof(*ud));
+    handle = &ud->handle;
     *handle = INVALID_HANDLE;
+    for (i = 0; i < ENDPOINT_SLOTS; ++i)
+	resetlatency(&ud->latency[i]);
     luaL_getmetatable(L, HANDLE_MT);
     lua_setmetatable(L, -2);
     /* associate handle with context */
@@ -320,38 +736,51 @@ static libusb_device_handle** newhandle(lua_State *L, int object)
 	lua_getfield(L, LUA_REGISTRYINDEX, DEVICES_REG);
 	lua_pushvalue(L, object);
 	lua_rawget(L, -2);
+	lua_remove(L, -2);
     }
     else
     {
 	lua_pop(L, 2);
 	lua_pushvalue(L, object);
     }
-    lua_getmetatable(L, -1);
-    luaL_getmetatable(L, CONTEXT_MT);
-    if (lua_rawequal(L, -1, -2))
+    if (lua_getmetatable(L, -1))
     {
+	luaL_getmetatable(L, CONTEXT_MT);
+	if (lua_rawequal(L, -1, -2))
+	{
+	    lua_pop(L, 2);
+	    ud->ctx = (struct lusb_context_ud*)lua_touserdata(L, -1);
+	    lua_getfield(L, LUA_REGISTRYINDEX, HANDLES_REG);
+	    lua_insert(L, -3);
+	    lua_rawset(L, -3);
+	    lua_pop(L, 1);
+	    return handle;
+	}
 	lua_pop(L, 2);
-	lua_getfield(L, LUA_REGISTRYINDEX, HANDLES_REG);
-	lua_insert(L, -3);
-	lua_rawset(L, -3);
-	lua_pop(L, 1);
-    }
-    else
-    {
-	/* not a context object, ignore it */
-	lua_pop(L, 4);
     }
+    /* not a context object, ignore it */
+    lua_pop(L, 2);
     return handle;
 }
 
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000102)
+static void hotplugexit(lua_State *L, struct lusb_context_ud *ud);
+#endif
+
 static int exitctx(lua_State *L)
 {
-    libusb_context **ud;
-    ud = (libusb_context**)luaL_checkudata(L, 1, CONTEXT_MT);
-    if (*ud != INVALID_CONTEXT)
+    struct lusb_context_ud *ud;
+    ud = (struct lusb_context_ud*)luaL_checkudata(L, 1, CONTEXT_MT);
+    if (ud->ctx != INVALID_CONTEXT)
     {
-    	libusb_exit(*ud);
-	*ud = INVALID_CONTEXT;
+	stopthread(ud);
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000102)
+	hotplugexit(L, ud);
+#endif
+	discardevents(L, ud);
+	closenotifier(ud);
+    	libusb_exit(ud->ctx);
+	ud->ctx = INVALID_CONTEXT;
     }
     return 0;
 }
@@ -370,25 +799,123 @@ static int unrefdev(lua_State *L)
 
 static int closehandle(lua_State *L)
 {
-    libusb_device_handle **ud;
-    ud = (libusb_device_handle**)luaL_checkudata(L, 1, HANDLE_MT);
-    if (*ud != INVALID_HANDLE)
+    struct lusb_handle_ud *ud;
+    ud = (struct lusb_handle_ud*)luaL_checkudata(L, 1, HANDLE_MT);
+    if (ud->handle != INVALID_HANDLE)
+    {
+	/* libusb_close must not run under transfers in flight */
+	if (ud->users > 0)
+	    ud->closed = ud->handle;
+	else
+	    libusb_close(ud->handle);
+	ud->handle = INVALID_HANDLE;
+    }
+    return 0;
+}
+
+/* drops a use, the last one finishes a deferred close */
+static void releasehandle(struct lusb_handle_ud *ud)
+{
+    if (--ud->users == 0 && ud->closed != NULL)
+    {
+	libusb_close(ud->closed);
+	ud->closed = NULL;
+    }
+}
+
+static int freebuffer(lua_State *L)
+{
+    struct lusb_buffer *ud;
+    ud = (struct lusb_buffer*)luaL_checkudata(L, 1, BUFFER_MT);
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+    /* a closed handle stays open in libusb until its mappings are gone */
+    if (ud->devmem != NULL)
+    {
+	libusb_dev_mem_free(ud->devmem->handle != INVALID_HANDLE ?
+			    ud->devmem->handle : ud->devmem->closed,
+			    ud->data, ud->length);
+	releasehandle(ud->devmem);
+    }
+#endif
+    ud->devmem = NULL;
+    /* a finalized buffer reads as empty */
+    ud->data = NULL;
+    ud->length = 0;
+    return 0;
+}
+
+static void freestream(struct lusb_stream *s)
+{
+    int i;
+    for (i = 0; i < s->depth; ++i)
+	if (s->slots[i].tx != NULL)
+	    libusb_free_transfer(s->slots[i].tx);
+    pthread_mutex_destroy(&s->lock);
+    free(s->memory);
+    free(s);
+}
+
+/* cancels the ring and runs events until every transfer is back */
+static void stopstream(struct lusb_stream **ud)
+{
+    struct lusb_stream *s;
+    struct lusb_handle_ud *handle;
+    int i;
+    if ((s = *ud) != NULL)
     {
-	libusb_close(*ud);
-	*ud = INVALID_HANDLE;
+	*ud = NULL;
+	pthread_mutex_lock(&s->lock);
+	s->closing = 1;
+	for (i = 0; i < s->depth; ++i)
+	    if (s->slots[i].busy)
+		libusb_cancel_transfer(s->slots[i].tx);
+	while (s->active > 0)
+	{
+	    s->completed = 0;
+	    pthread_mutex_unlock(&s->lock);
+	    i = libusb_handle_events_completed(s->ctx, &s->completed);
+	    pthread_mutex_lock(&s->lock);
+	    if (i != 0 && i != LIBUSB_ERROR_INTERRUPTED)
+		break;
+	}
+	if (s->active > 0)
+	{
+	    /* the last cancelled transfer frees it, the handle stays open */
+	    s->orphaned = 1;
+	    pthread_mutex_unlock(&s->lock);
+	}
+	else
+	{
+	    handle = s->handle;
+	    pthread_mutex_unlock(&s->lock);
+	    freestream(s);
+	    if (handle != NULL)
+		releasehandle(handle);
+	}
     }
+}
+
+/* the handle is finalized after the stream, so it is still open here */
+static int closestream(lua_State *L)
+{
+    struct lusb_stream **ud;
+    ud = (struct lusb_stream**)luaL_checkudata(L, 1, STREAM_MT);
+    stopstream(ud);
     return 0;
 }
 
 static int freetransfer(lua_State *L)
 {
-    struct libusb_transfer **ud;
-    ud = (struct libusb_transfer**)luaL_checkudata(L, 1, TRANSFER_MT);
-    if (*ud != INVALID_TRANSFER)
+    struct lusb_transfer_ud *ud;
+    ud = (struct lusb_transfer_ud*)luaL_checkudata(L, 1, TRANSFER_MT);
+    if (ud->tx != INVALID_TRANSFER)
     {
-	libusb_free_transfer(*ud);
-	*ud = INVALID_TRANSFER;
+	libusb_free_transfer(ud->tx);
+	ud->tx = INVALID_TRANSFER;
     }
+    free(ud->cbuf);
+    ud->cbuf = NULL;
+    ud->csize = 0;
     return 0;
 }
 
@@ -571,6 +1098,27 @@ static libusb_context* getctx(lua_State *L, int ix)
     return *ctx;
 }
 
+static int optintfield(lua_State *L, int obj, const char *k, int d)
+{
+    lua_getfield(L, obj, k);
+    if (lua_isnumber(L, -1))
+	d = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    return d;
+}
+
+/* context object at ix, or the default context when it's absent */
+static struct lusb_context_ud* getctxud(lua_State *L, int ix)
+{
+    if (!lua_isnoneornil(L, ix))
+    {
+	getctx(L, ix);
+	return (struct lusb_context_ud*)lua_touserdata(L, ix);
+    }
+    defctx(L);
+    return (struct lusb_context_ud*)lua_touserdata(L, -1);
+}
+
 static libusb_device* getdev(lua_State *L, int ix)
 {
     libusb_device **dev;
@@ -580,6 +1128,70 @@ static libusb_device* getdev(lua_State *L, int ix)
     return *dev;
 }
 
+/* cache table for one kind of descriptor of the device at ix */
+static int desccache(lua_State *L, int ix, const char *what)
+{
+    ix = lua_absindex(L, ix);
+    lua_getfield(L, LUA_REGISTRYINDEX, DESC_REG);
+    lua_pushvalue(L, ix);
+    lua_rawget(L, -2);
+    if (lua_isnil(L, -1))
+    {
+	lua_pop(L, 1);
+	lua_createtable(L, 0, 4);
+	lua_pushvalue(L, ix);
+	lua_pushvalue(L, -2);
+	lua_rawset(L, -4);
+    }
+    lua_getfield(L, -1, what);
+    if (lua_isnil(L, -1))
+    {
+	lua_pop(L, 1);
+	lua_newtable(L);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -3, what);
+    }
+    lua_replace(L, -3);
+    lua_pop(L, 1);
+    return lua_gettop(L);
+}
+
+/* deep copy of the descriptor table at ix, the cache keeps the original */
+static void copydesc(lua_State *L, int ix)
+{
+    ix = lua_absindex(L, ix);
+    luaL_checkstack(L, 4, "descriptor too deep");
+    lua_newtable(L);
+    lua_pushnil(L);
+    while (lua_next(L, ix))
+    {
+	lua_pushvalue(L, -2);
+	if (lua_istable(L, -2))
+	    copydesc(L, -2);
+	else
+	    lua_pushvalue(L, -2);
+	lua_rawset(L, -5);
+	lua_pop(L, 1);
+    }
+}
+
+/* forget the cached descriptors of the device of a handle */
+static void uncachedesc(lua_State *L, libusb_device_handle *handle)
+{
+    lua_getfield(L, LUA_REGISTRYINDEX, DESC_REG);
+    lua_getfield(L, LUA_REGISTRYINDEX, DEVPTR_REG);
+    lua_pushlightuserdata(L, libusb_get_device(handle));
+    lua_rawget(L, -2);
+    if (!lua_isnil(L, -1))
+    {
+	lua_pushnil(L);
+	lua_rawset(L, -4);
+	lua_pop(L, 2);
+    }
+    else
+	lua_pop(L, 3);
+}
+
 static libusb_device_handle* gethandle(lua_State *L, int ix)
 {
     libusb_device_handle **handle;
@@ -589,21 +1201,190 @@ static libusb_device_handle* gethandle(lua_State *L, int ix)
     return *handle;
 }
 
-static struct libusb_transfer* gettransfer(lua_State *L, int ix)
+/* context object of a handle, NULL if there isn't one */
+static struct lusb_context_ud* handlectxud(lua_State *L, int ix)
 {
-    struct libusb_transfer **transfer;
-    transfer = (struct libusb_transfer**)luaL_checkudata(L, ix, TRANSFER_MT);
-    if (*transfer == INVALID_TRANSFER)
-	luaL_error(L, "attempt to use an invalid transfer");
-    return *transfer;
+    struct lusb_context_ud *ud = NULL;
+    ix = lua_absindex(L, ix);
+    lua_getfield(L, LUA_REGISTRYINDEX, HANDLES_REG);
+    lua_pushvalue(L, ix);
+    lua_rawget(L, -2);
+    if (lua_getmetatable(L, -1))
+    {
+	luaL_getmetatable(L, CONTEXT_MT);
+	if (lua_rawequal(L, -1, -2))
+	    ud = (struct lusb_context_ud*)lua_touserdata(L, -3);
+	lua_pop(L, 2);
+    }
+    lua_pop(L, 2);
+    return ud;
 }
 
-static int lusb_init(lua_State *L)
+/* context of a handle object, NULL for the default context */
+static libusb_context* handlectx(lua_State *L, int ix)
 {
-    int err;
-    libusb_context **ctx = newctx(L);
-    if ((err = libusb_init(ctx)) != 0)
-	return _err(L, err);
+    struct lusb_context_ud *ud = handlectxud(L, ix);
+    return ud != NULL ? ud->ctx : NULL;
+}
+
+static void countinto(struct lusb_counters *c, int in, int status, int len)
+{
+    if (len > 0)
+	l_atomic_add(in ? &c->bytes_in : &c->bytes_out, (unsigned long long)len);
+    switch (status)
+    {
+    case LIBUSB_TRANSFER_COMPLETED:
+	l_atomic_add(&c->completed, 1);
+	break;
+    case LIBUSB_TRANSFER_TIMED_OUT:
+	l_atomic_add(&c->timeouts, 1);
+	break;
+    case LIBUSB_TRANSFER_STALL:
+	l_atomic_add(&c->stalls, 1);
+	break;
+    case LIBUSB_TRANSFER_OVERFLOW:
+	l_atomic_add(&c->overflows, 1);
+	break;
+    case LIBUSB_TRANSFER_CANCELLED:
+	l_atomic_add(&c->cancelled, 1);
+	break;
+    case LIBUSB_TRANSFER_NO_DEVICE:
+	l_atomic_add(&c->no_device, 1);
+	break;
+    default:
+	l_atomic_add(&c->errors, 1);
+	break;
+    }
+}
+
+/* ep only needs the direction bit for control transfers */
+static void counttransfer(struct lusb_handle_ud *h, int ep, int status, int len)
+{
+    int in = (ep & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN;
+    countinto(&h->total, in, status, len);
+    countinto(&h->counters[EPINDEX(ep)], in, status, len);
+    if (h->ctx != NULL)
+	countinto(&h->ctx->counters, in, status, len);
+}
+
+/* counts the result of a synchronous call on the handle at ix */
+static void countsync(lua_State *L, int ix, int ep, int err, int len)
+{
+    int status;
+    switch (err)
+    {
+    case LIBUSB_ERROR_TIMEOUT:
+	status = LIBUSB_TRANSFER_TIMED_OUT;
+	break;
+    case LIBUSB_ERROR_PIPE:
+	status = LIBUSB_TRANSFER_STALL;
+	break;
+    case LIBUSB_ERROR_OVERFLOW:
+	status = LIBUSB_TRANSFER_OVERFLOW;
+	break;
+    case LIBUSB_ERROR_NO_DEVICE:
+	status = LIBUSB_TRANSFER_NO_DEVICE;
+	break;
+    default:
+	status = err < 0 ? LIBUSB_TRANSFER_ERROR : LIBUSB_TRANSFER_COMPLETED;
+	break;
+    }
+    /* libusb leaves the length alone when the submit itself fails */
+    if (err < 0 && err != LIBUSB_ERROR_TIMEOUT)
+	len = 0;
+    counttransfer((struct lusb_handle_ud*)lua_touserdata(L, ix), ep, status, len);
+}
+
+static struct libusb_transfer* gettransfer(lua_State *L, int ix)
+{
+    struct libusb_transfer **transfer;
+    transfer = (struct libusb_transfer**)luaL_checkudata(L, ix, TRANSFER_MT);
+    if (*transfer == INVALID_TRANSFER)
+	luaL_error(L, "attempt to use an invalid transfer");
+    return *transfer;
+}
+
+static struct lusb_buffer* getbuffer(lua_State *L, int ix)
+{
+    return (struct lusb_buffer*)luaL_checkudata(L, ix, BUFFER_MT);
+}
+
+static struct lusb_buffer* tobuffer(lua_State *L, int ix)
+{
+    struct lusb_buffer *buf = NULL;
+    if (lua_getmetatable(L, ix))
+    {
+	luaL_getmetatable(L, BUFFER_MT);
+	if (lua_rawequal(L, -1, -2))
+	    buf = (struct lusb_buffer*)lua_touserdata(L, ix);
+	lua_pop(L, 2);
+    }
+    return buf;
+}
+
+static struct lusb_buffer* newbuffer(lua_State *L, size_t len)
+{
+    struct lusb_buffer *buf;
+    buf = (struct lusb_buffer*)lua_newuserdata(L, sizeof(struct lusb_buffer)+len);
+    buf->data = (unsigned char*)(buf+1);
+    buf->length = len;
+    buf->devmem = NULL;
+    luaL_getmetatable(L, BUFFER_MT);
+    lua_setmetatable(L, -2);
+    return buf;
+}
+
+static struct lusb_buffer* newview(lua_State *L, int owner,
+				   unsigned char *data, size_t len)
+{
+    struct lusb_buffer *buf;
+    owner = lua_absindex(L, owner);
+    buf = (struct lusb_buffer*)lua_newuserdata(L, sizeof(struct lusb_buffer));
+    buf->data = data;
+    buf->length = len;
+    buf->devmem = NULL;
+    luaL_getmetatable(L, BUFFER_MT);
+    lua_setmetatable(L, -2);
+    /* the view keeps the owner of the memory alive, not other views */
+    lua_getfield(L, LUA_REGISTRYINDEX, VIEWS_REG);
+    lua_pushvalue(L, owner);
+    lua_rawget(L, -2);
+    if (lua_isnil(L, -1))
+    {
+	lua_pop(L, 1);
+	lua_pushvalue(L, owner);
+    }
+    lua_pushvalue(L, -3);
+    lua_insert(L, -2);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+    return buf;
+}
+
+/* string.sub style range, returns 0-based start and length */
+static size_t bufrange(lua_State *L, size_t len, int ii, lua_Integer di,
+		       int ij, lua_Integer dj, size_t *start)
+{
+    lua_Integer i = luaL_optinteger(L, ii, di);
+    lua_Integer j = luaL_optinteger(L, ij, dj);
+    if (i < 0)
+	i = (lua_Integer)len + i + 1;
+    if (j < 0)
+	j = (lua_Integer)len + j + 1;
+    if (i < 1)
+	i = 1;
+    if (j > (lua_Integer)len)
+	j = (lua_Integer)len;
+    *start = (size_t)i - 1;
+    return (i > j) ? 0 : (size_t)(j - i + 1);
+}
+
+static int lusb_init(lua_State *L)
+{
+    int err;
+    libusb_context **ctx = newctx(L);
+    if ((err = libusb_init(ctx)) != 0)
+	return _err(L, err);
     return 1;
 }
 
@@ -653,6 +1434,140 @@ static int lusb_get_device_list(lua_State *L)
     return 1;
 }
 
+/*
+ * Each context keeps a snapshot { gen, present, seen, removed }.
+ * present maps devices to the generation they appeared in, seen to the
+ * last scan that listed them, and removed (weak) to when they went away.
+ */
+static int lusb_get_device_changes(lua_State *L)
+{
+    libusb_context *ctx;
+    libusb_device **devlist;
+    ssize_t numdevices, n;
+    lua_Integer token, gen;
+    int snap, present, seen, removed, added, gone, i;
+    if (lua_isuserdata(L, 1))
+    {
+	ctx = getctx(L, 1);
+	token = luaL_optinteger(L, 2, 0);
+	lua_settop(L, 1);
+    }
+    else
+    {
+	token = luaL_optinteger(L, 1, 0);
+	lua_settop(L, 0);
+	ctx = defctx(L);
+    }
+    numdevices = libusb_get_device_list(ctx, &devlist);
+    if (numdevices < 0)
+	return _err(L, numdevices);
+    lua_getfield(L, LUA_REGISTRYINDEX, CHANGES_REG);
+    lua_pushvalue(L, 1);
+    lua_rawget(L, -2);
+    if (lua_isnil(L, -1))
+    {
+	lua_pop(L, 1);
+	lua_createtable(L, 4, 0);
+	lua_pushinteger(L, 0);
+	lua_rawseti(L, -2, 1);
+	lua_newtable(L);
+	lua_rawseti(L, -2, 2);
+	lua_newtable(L);
+	lua_rawseti(L, -2, 3);
+	lua_newtable(L);
+	lua_createtable(L, 0, 1);
+	lua_pushliteral(L, "k");
+	lua_setfield(L, -2, "__mode");
+	lua_setmetatable(L, -2);
+	lua_rawseti(L, -2, 4);
+	lua_pushvalue(L, 1);
+	lua_pushvalue(L, -2);
+	lua_rawset(L, -4);
+    }
+    snap = lua_gettop(L);
+    lua_rawgeti(L, snap, 1);
+    gen = lua_tointeger(L, -1) + 1;
+    lua_pop(L, 1);
+    lua_pushinteger(L, gen);
+    lua_rawseti(L, snap, 1);
+    lua_rawgeti(L, snap, 2);
+    present = lua_gettop(L);
+    lua_rawgeti(L, snap, 3);
+    seen = lua_gettop(L);
+    lua_rawgeti(L, snap, 4);
+    removed = lua_gettop(L);
+    for (n = 0; n < numdevices; ++n)
+    {
+	/* existing objects are found through DEVPTR_REG */
+	newdev(L, 1, devlist[n]);
+	lua_pushvalue(L, -1);
+	lua_rawget(L, present);
+	if (lua_isnil(L, -1))
+	{
+	    lua_pushvalue(L, -2);
+	    lua_pushinteger(L, gen);
+	    lua_rawset(L, present);
+	    lua_pushvalue(L, -2);
+	    lua_pushnil(L);
+	    lua_rawset(L, removed);
+	}
+	lua_pop(L, 1);
+	lua_pushinteger(L, gen);
+	lua_rawset(L, seen);
+    }
+    libusb_free_device_list(devlist, 1);
+    /* anything not listed this time is gone */
+    lua_pushnil(L);
+    while (lua_next(L, present))
+    {
+	lua_pop(L, 1);
+	lua_pushvalue(L, -1);
+	lua_rawget(L, seen);
+	if (lua_tointeger(L, -1) != gen)
+	{
+	    lua_pushvalue(L, -2);
+	    lua_pushnil(L);
+	    lua_rawset(L, present);
+	    lua_pushvalue(L, -2);
+	    lua_pushnil(L);
+	    lua_rawset(L, seen);
+	    lua_pushvalue(L, -2);
+	    lua_pushinteger(L, gen);
+	    lua_rawset(L, removed);
+	}
+	lua_pop(L, 1);
+    }
+    lua_newtable(L);
+    added = lua_gettop(L);
+    lua_newtable(L);
+    gone = lua_gettop(L);
+    i = 0;
+    lua_pushnil(L);
+    while (lua_next(L, present))
+    {
+	if (lua_tointeger(L, -1) > token)
+	{
+	    lua_pushvalue(L, -2);
+	    lua_rawseti(L, added, ++i);
+	}
+	lua_pop(L, 1);
+    }
+    i = 0;
+    lua_pushnil(L);
+    while (token > 0 && lua_next(L, removed))
+    {
+	if (lua_tointeger(L, -1) > token)
+	{
+	    lua_pushvalue(L, -2);
+	    lua_rawseti(L, gone, ++i);
+	}
+	lua_pop(L, 1);
+    }
+    lua_settop(L, gone);
+    lua_pushinteger(L, gen);
+    return 3;
+}
+
 static int lusb_get_bus_number(lua_State *L)
 {
     libusb_device *dev = getdev(L, 1);
@@ -689,15 +1604,30 @@ static int lusb_get_max_iso_packet_size(lua_State *L)
     return 1;
 }
 
+/*
+ * Descriptor tables are cached on the device object and each call gets
+ * its own copy, so callers may modify them. set_configuration and
+ * reset_device drop the cache.
+ */
 static int lusb_get_device_descriptor(lua_State *L)
 {
     struct libusb_device_descriptor desc;
     libusb_device *dev;
-    int err;
+    int cache, err;
     dev = getdev(L, 1);
+    cache = desccache(L, 1, "device");
+    lua_rawgeti(L, cache, 0);
+    if (!lua_isnil(L, -1))
+    {
+	copydesc(L, -1);
+	return 1;
+    }
     if ((err = libusb_get_device_descriptor(dev, &desc)) != 0)
 	return _err(L, err);
     pushdevicedesc(L, &desc);
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, cache, 0);
+    copydesc(L, -1);
     return 1;
 }
 
@@ -705,12 +1635,22 @@ static int lusb_get_active_config_descriptor(lua_State *L)
 {
     struct libusb_config_descriptor *desc;
     libusb_device *dev;
-    int err;
+    int cache, err;
     dev = getdev(L, 1);
+    cache = desccache(L, 1, "active");
+    lua_rawgeti(L, cache, 0);
+    if (!lua_isnil(L, -1))
+    {
+	copydesc(L, -1);
+	return 1;
+    }
     if ((err = libusb_get_active_config_descriptor(dev, &desc)) != 0)
 	return _err(L, err);
     pushconfigdesc(L, desc);
     libusb_free_config_descriptor(desc);
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, cache, 0);
+    copydesc(L, -1);
     return 1;
 }
 
@@ -718,13 +1658,23 @@ static int lusb_get_config_descriptor(lua_State *L)
 {
     struct libusb_config_descriptor *desc;
     libusb_device *dev;
-    int idx, err;
+    int idx, cache, err;
     dev = getdev(L, 1);
     idx = luaL_checkinteger(L, 2);
+    cache = desccache(L, 1, "index");
+    lua_rawgeti(L, cache, idx);
+    if (!lua_isnil(L, -1))
+    {
+	copydesc(L, -1);
+	return 1;
+    }
     if ((err = libusb_get_config_descriptor(dev, idx, &desc)) != 0)
 	return _err(L, err);
     pushconfigdesc(L, desc);
     libusb_free_config_descriptor(desc);
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, cache, idx);
+    copydesc(L, -1);
     return 1;
 }
 
@@ -732,13 +1682,323 @@ static int lusb_get_config_descriptor_by_value(lua_State *L)
 {
     struct libusb_config_descriptor *desc;
     libusb_device *dev;
-    int val, err;
+    int val, cache, err;
     dev = getdev(L, 1);
     val = luaL_checkinteger(L, 2);
+    cache = desccache(L, 1, "value");
+    lua_rawgeti(L, cache, val);
+    if (!lua_isnil(L, -1))
+    {
+	copydesc(L, -1);
+	return 1;
+    }
     if ((err = libusb_get_config_descriptor_by_value(dev, val, &desc)) != 0)
 	return _err(L, err);
     pushconfigdesc(L, desc);
     libusb_free_config_descriptor(desc);
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, cache, val);
+    copydesc(L, -1);
+    return 1;
+}
+
+/*
+ * Descriptor proxies read fields straight out of the libusb structures.
+ * Interface and endpoint proxies point into their config descriptor,
+ * which is kept alive through DESCOWNER_REG.
+ */
+/* minlen: the field is nil when bLength is shorter, 0 if always present */
+struct l_field { const char *name; size_t offset; size_t size; int minlen; };
+#define dfield(T,f)	{#f, offsetof(T,f), sizeof(((T*)0)->f), 0}
+#define dfieldn(T,f,n)	{#f, offsetof(T,f), sizeof(((T*)0)->f), n}
+
+static const struct l_field lusb_device_fields[] = {
+    dfield(struct libusb_device_descriptor, bLength),
+    dfield(struct libusb_device_descriptor, bDescriptorType),
+    dfield(struct libusb_device_descriptor, bcdUSB),
+    dfield(struct libusb_device_descriptor, bDeviceClass),
+    dfield(struct libusb_device_descriptor, bDeviceSubClass),
+    dfield(struct libusb_device_descriptor, bDeviceProtocol),
+    dfield(struct libusb_device_descriptor, bMaxPacketSize0),
+    dfield(struct libusb_device_descriptor, idVendor),
+    dfield(struct libusb_device_descriptor, idProduct),
+    dfield(struct libusb_device_descriptor, bcdDevice),
+    dfield(struct libusb_device_descriptor, iManufacturer),
+    dfield(struct libusb_device_descriptor, iProduct),
+    dfield(struct libusb_device_descriptor, iSerialNumber),
+    dfield(struct libusb_device_descriptor, bNumConfigurations),
+    {NULL, 0, 0, 0}
+};
+
+static const struct l_field lusb_config_fields[] = {
+    dfield(struct libusb_config_descriptor, bLength),
+    dfield(struct libusb_config_descriptor, bDescriptorType),
+    dfield(struct libusb_config_descriptor, wTotalLength),
+    dfield(struct libusb_config_descriptor, bNumInterfaces),
+    dfield(struct libusb_config_descriptor, bConfigurationValue),
+    dfield(struct libusb_config_descriptor, iConfiguration),
+    dfield(struct libusb_config_descriptor, bmAttributes),
+    dfield(struct libusb_config_descriptor, MaxPower),
+    {NULL, 0, 0, 0}
+};
+
+static const struct l_field lusb_interface_fields[] = {
+    dfield(struct libusb_interface_descriptor, bLength),
+    dfield(struct libusb_interface_descriptor, bDescriptorType),
+    dfield(struct libusb_interface_descriptor, bInterfaceNumber),
+    dfield(struct libusb_interface_descriptor, bAlternateSetting),
+    dfield(struct libusb_interface_descriptor, bNumEndpoints),
+    dfield(struct libusb_interface_descriptor, bInterfaceClass),
+    dfield(struct libusb_interface_descriptor, bInterfaceSubClass),
+    dfield(struct libusb_interface_descriptor, bInterfaceProtocol),
+    dfield(struct libusb_interface_descriptor, iInterface),
+    {NULL, 0, 0, 0}
+};
+
+static const struct l_field lusb_endpoint_fields[] = {
+    dfield(struct libusb_endpoint_descriptor, bLength),
+    dfield(struct libusb_endpoint_descriptor, bDescriptorType),
+    dfield(struct libusb_endpoint_descriptor, bEndpointAddress),
+    dfield(struct libusb_endpoint_descriptor, bmAttributes),
+    dfield(struct libusb_endpoint_descriptor, wMaxPacketSize),
+    dfield(struct libusb_endpoint_descriptor, bInterval),
+    dfieldn(struct libusb_endpoint_descriptor, bRefresh, LIBUSB_DT_ENDPOINT_AUDIO_SIZE),
+    dfieldn(struct libusb_endpoint_descriptor, bSynchAddress, LIBUSB_DT_ENDPOINT_AUDIO_SIZE),
+    {NULL, 0, 0, 0}
+};
+
+/* __index with the methods and field list as upvalues */
+static int descindex(lua_State *L)
+{
+    const struct l_field *f;
+    const unsigned char *desc;
+    const char *k;
+    lua_pushvalue(L, 2);
+    lua_rawget(L, lua_upvalueindex(1));
+    if (!lua_isnil(L, -1) || lua_type(L, 2) != LUA_TSTRING)
+	return 1;
+    desc = *(const unsigned char**)lua_touserdata(L, 1);
+    k = lua_tostring(L, 2);
+    for (f = lua_touserdata(L, lua_upvalueindex(2)); f->name != NULL; ++f)
+	if (strcmp(f->name, k) == 0)
+	{
+	    /* bLength comes first in every descriptor */
+	    if (f->minlen > 0 && desc[0] < f->minlen)
+		lua_pushnil(L);
+	    else if (f->size == sizeof(uint16_t))
+		lua_pushinteger(L, *(const uint16_t*)(desc + f->offset));
+	    else
+		lua_pushinteger(L, *(const uint8_t*)(desc + f->offset));
+	    break;
+	}
+    return 1;
+}
+
+static const void* getdesc(lua_State *L, int ix, const char *mt)
+{
+    return *(const void**)luaL_checkudata(L, ix, mt);
+}
+
+static void newdescproxy(lua_State *L, int owner, const char *mt, const void *desc)
+{
+    const void **ud;
+    if (owner != 0)
+	owner = lua_absindex(L, owner);
+    ud = (const void**)lua_newuserdata(L, sizeof(void*));
+    *ud = desc;
+    luaL_getmetatable(L, mt);
+    lua_setmetatable(L, -2);
+    if (owner != 0)
+    {
+	lua_getfield(L, LUA_REGISTRYINDEX, DESCOWNER_REG);
+	lua_pushvalue(L, -2);
+	lua_pushvalue(L, owner);
+	lua_rawset(L, -3);
+	lua_pop(L, 1);
+    }
+}
+
+static int freeconfigdesc(lua_State *L)
+{
+    struct libusb_config_descriptor **ud;
+    ud = (struct libusb_config_descriptor**)luaL_checkudata(L, 1, CONFIGDESC_MT);
+    if (*ud != NULL)
+    {
+	libusb_free_config_descriptor(*ud);
+	*ud = NULL;
+    }
+    return 0;
+}
+
+/* a copy of the descriptor follows the pointer */
+struct lusb_devdesc_ud
+{
+    const struct libusb_device_descriptor *desc;
+    struct libusb_device_descriptor data;
+};
+
+static int lusb_get_device_descriptor_proxy(lua_State *L)
+{
+    struct lusb_devdesc_ud *ud;
+    libusb_device *dev;
+    int err;
+    dev = getdev(L, 1);
+    ud = (struct lusb_devdesc_ud*)lua_newuserdata(L, sizeof(struct lusb_devdesc_ud));
+    ud->desc = &ud->data;
+    luaL_getmetatable(L, DEVDESC_MT);
+    lua_setmetatable(L, -2);
+    if ((err = libusb_get_device_descriptor(dev, &ud->data)) != 0)
+	return _err(L, err);
+    return 1;
+}
+
+static struct libusb_config_descriptor** newconfigproxy(lua_State *L)
+{
+    newdescproxy(L, 0, CONFIGDESC_MT, NULL);
+    return (struct libusb_config_descriptor**)lua_touserdata(L, -1);
+}
+
+static int lusb_get_active_config_descriptor_proxy(lua_State *L)
+{
+    libusb_device *dev;
+    int err;
+    dev = getdev(L, 1);
+    if ((err = libusb_get_active_config_descriptor(dev, newconfigproxy(L))) != 0)
+	return _err(L, err);
+    return 1;
+}
+
+static int lusb_get_config_descriptor_proxy(lua_State *L)
+{
+    libusb_device *dev;
+    int idx, err;
+    dev = getdev(L, 1);
+    idx = luaL_checkinteger(L, 2);
+    if ((err = libusb_get_config_descriptor(dev, idx, newconfigproxy(L))) != 0)
+	return _err(L, err);
+    return 1;
+}
+
+static int lusb_get_config_descriptor_by_value_proxy(lua_State *L)
+{
+    libusb_device *dev;
+    int val, err;
+    dev = getdev(L, 1);
+    val = luaL_checkinteger(L, 2);
+    if ((err = libusb_get_config_descriptor_by_value(dev, val, newconfigproxy(L))) != 0)
+	return _err(L, err);
+    return 1;
+}
+
+static int lusb_config_desc_len(lua_State *L)
+{
+    const struct libusb_config_descriptor *desc = getdesc(L, 1, CONFIGDESC_MT);
+    lua_pushinteger(L, desc->bNumInterfaces);
+    return 1;
+}
+
+static int lusb_config_desc_num_altsetting(lua_State *L)
+{
+    const struct libusb_config_descriptor *desc = getdesc(L, 1, CONFIGDESC_MT);
+    int i = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, i >= 1 && i <= desc->bNumInterfaces, 2, "invalid interface");
+    lua_pushinteger(L, desc->interface[i-1].num_altsetting);
+    return 1;
+}
+
+/* interface i, alternate setting alt, both from 1 */
+static int lusb_config_desc_interface(lua_State *L)
+{
+    const struct libusb_config_descriptor *desc = getdesc(L, 1, CONFIGDESC_MT);
+    int i = luaL_checkinteger(L, 2);
+    int alt = luaL_optinteger(L, 3, 1);
+    if (i < 1 || i > desc->bNumInterfaces
+     || alt < 1 || alt > desc->interface[i-1].num_altsetting)
+    {
+	lua_pushnil(L);
+	return 1;
+    }
+    newdescproxy(L, 1, IFACEDESC_MT, desc->interface[i-1].altsetting + alt-1);
+    return 1;
+}
+
+static int configiter(lua_State *L)
+{
+    const struct libusb_config_descriptor *desc;
+    int i, alt;
+    desc = *(const struct libusb_config_descriptor**)lua_touserdata(L, lua_upvalueindex(1));
+    i = lua_tointeger(L, lua_upvalueindex(2));
+    alt = lua_tointeger(L, lua_upvalueindex(3));
+    while (i < desc->bNumInterfaces && alt >= desc->interface[i].num_altsetting)
+    {
+	++i;
+	alt = 0;
+    }
+    if (i >= desc->bNumInterfaces)
+	return 0;
+    newdescproxy(L, lua_upvalueindex(1), IFACEDESC_MT, desc->interface[i].altsetting + alt);
+    lua_pushinteger(L, i+1);
+    lua_pushinteger(L, alt+1);
+    lua_pushinteger(L, i);
+    lua_replace(L, lua_upvalueindex(2));
+    lua_pushinteger(L, alt+1);
+    lua_replace(L, lua_upvalueindex(3));
+    return 3;
+}
+
+/* iterate every alternate setting: proxy, interface, alt */
+static int lusb_config_desc_interfaces(lua_State *L)
+{
+    getdesc(L, 1, CONFIGDESC_MT);
+    lua_settop(L, 1);
+    lua_pushinteger(L, 0);
+    lua_pushinteger(L, 0);
+    lua_pushcclosure(L, configiter, 3);
+    return 1;
+}
+
+static int lusb_interface_desc_len(lua_State *L)
+{
+    const struct libusb_interface_descriptor *desc = getdesc(L, 1, IFACEDESC_MT);
+    lua_pushinteger(L, desc->bNumEndpoints);
+    return 1;
+}
+
+static int lusb_interface_desc_endpoint(lua_State *L)
+{
+    const struct libusb_interface_descriptor *desc = getdesc(L, 1, IFACEDESC_MT);
+    int i = luaL_checkinteger(L, 2);
+    if (i < 1 || i > desc->bNumEndpoints)
+    {
+	lua_pushnil(L);
+	return 1;
+    }
+    newdescproxy(L, 1, ENDPDESC_MT, desc->endpoint + i-1);
+    return 1;
+}
+
+static int interfaceiter(lua_State *L)
+{
+    const struct libusb_interface_descriptor *desc;
+    int i;
+    desc = *(const struct libusb_interface_descriptor**)lua_touserdata(L, lua_upvalueindex(1));
+    i = lua_tointeger(L, lua_upvalueindex(2));
+    if (i >= desc->bNumEndpoints)
+	return 0;
+    newdescproxy(L, lua_upvalueindex(1), ENDPDESC_MT, desc->endpoint + i);
+    lua_pushinteger(L, i+1);
+    lua_pushinteger(L, i+1);
+    lua_replace(L, lua_upvalueindex(2));
+    return 2;
+}
+
+/* iterate the endpoints: proxy, index */
+static int lusb_interface_desc_endpoints(lua_State *L)
+{
+    getdesc(L, 1, IFACEDESC_MT);
+    lua_settop(L, 1);
+    lua_pushinteger(L, 0);
+    lua_pushcclosure(L, interfaceiter, 2);
     return 1;
 }
 
@@ -826,33 +2086,14 @@ static int lusb_get_string_descriptor_ascii(lua_State *L)
     return 1;
 }
 
-static int lusb_get_string_descriptor_utf8(lua_State *L)
+static void pushutf16(lua_State *L, const uint16_t *str, size_t len)
 {
-    struct usb_string_descriptor desc;
-    libusb_device_handle *handle;
-    int idx, langid;
-    size_t len, i;
-    int err;
     luaL_Buffer buffer;
-    handle = gethandle(L, 1);
-    idx = luaL_checkinteger(L, 2);
-    if (idx == 0)
-	return _err(L, LIBUSB_ERROR_INVALID_PARAM);
-    len = sizeof(struct usb_string_descriptor);
-    err = libusb_get_string_descriptor(handle, 0, 0, (unsigned char*)&desc, len);
-    if (err < 0)
-	return _err(L, err);
-    if (err < 4)
-	return _err(L, LIBUSB_ERROR_IO);
-    langid = desc.bString[0];
-    err = libusb_get_string_descriptor(handle, idx, langid, (unsigned char*)&desc, len);
-    if (err < 0)
-	return _err(L, err);
-    len = (err > 0 && desc.bLength > 1) ? (desc.bLength - 2)/2 : 0;
+    size_t i;
     luaL_buffinit(L, &buffer);
     for (i = 0; i < len; ++i)
     {
-	unsigned int ch = desc.bString[i];
+	unsigned int ch = str[i];
 	if (ch < 0x80)
 	{
 	    luaL_addchar(&buffer, ch);
@@ -864,14 +2105,15 @@ static int lusb_get_string_descriptor_utf8(lua_State *L)
 	}
 	else if ((ch&0xF800) == 0xD800)
 	{
-	    unsigned int ch2 = desc.bString[i+1];
-	    if ((ch2&0xFC00) == 0xDC00)
+	    unsigned int ch2 = i+1 < len ? str[i+1] : 0;
+	    if ((ch&0xFC00) == 0xD800 && (ch2&0xFC00) == 0xDC00)
 	    {
 		ch = (((ch&0x3FF)<<10)|(ch2&0x3FF)) + 0x10000;
 		luaL_addchar(&buffer, (ch>>18)|0xF0);
 		luaL_addchar(&buffer, ((ch>>12)&0x3F)|0x80);
 		luaL_addchar(&buffer, ((ch>>6)&0x3F)|0x80);
 		luaL_addchar(&buffer, (ch&0x3F)|0x80);
+		++i;
 	    }
 	    else
 	    {
@@ -888,55 +2130,433 @@ static int lusb_get_string_descriptor_utf8(lua_State *L)
 	}
     }
     luaL_pushresult(&buffer);
+}
+
+/* push the device object of the device or handle at ix */
+static void pushdevobj(lua_State *L, int ix)
+{
+    int isdev = 0;
+    ix = lua_absindex(L, ix);
+    if (lua_getmetatable(L, ix))
+    {
+	luaL_getmetatable(L, DEVICE_MT);
+	isdev = lua_rawequal(L, -1, -2);
+	lua_pop(L, 2);
+    }
+    if (isdev)
+	lua_pushvalue(L, ix);
+    else
+	newdev(L, ix, libusb_get_device(gethandle(L, ix)));
+}
+
+/*
+ * Strings of a device, as { [0] = langid, [index] = string }, shared by
+ * all of its handles. ix is a device or a handle.
+ */
+static int stringcache(lua_State *L, int ix)
+{
+    ix = lua_absindex(L, ix);
+    lua_getfield(L, LUA_REGISTRYINDEX, STRINGS_REG);
+    pushdevobj(L, ix);
+    lua_pushvalue(L, -1);
+    lua_rawget(L, -3);
+    if (lua_isnil(L, -1))
+    {
+	lua_pop(L, 1);
+	lua_newtable(L);
+	lua_pushvalue(L, -2);
+	lua_pushvalue(L, -2);
+	lua_rawset(L, -5);
+    }
+    lua_replace(L, -3);
+    lua_pop(L, 1);
+    return lua_gettop(L);
+}
+
+/* push the string at idx, from the cache when possible */
+static int getstring(lua_State *L, libusb_device_handle *handle, int cache, int idx)
+{
+    struct usb_string_descriptor desc;
+    int langid, err, len;
+    lua_rawgeti(L, cache, idx);
+    if (!lua_isnil(L, -1))
+	return 0;
+    lua_pop(L, 1);
+    lua_rawgeti(L, cache, 0);
+    langid = lua_tointeger(L, -1);
+    if (lua_isnil(L, -1))
+    {
+	err = libusb_get_string_descriptor(handle, 0, 0, (unsigned char*)&desc, sizeof(desc));
+	if (err < 0)
+	    return err;
+	if (err < 4)
+	    return LIBUSB_ERROR_IO;
+	langid = desc.bString[0];
+	lua_pushinteger(L, langid);
+	lua_rawseti(L, cache, 0);
+    }
+    lua_pop(L, 1);
+    err = libusb_get_string_descriptor(handle, idx, langid, (unsigned char*)&desc, sizeof(desc));
+    if (err < 0)
+	return err;
+    /* a short read must not decode stale bytes into the cache */
+    if (err < 2)
+	return LIBUSB_ERROR_IO;
+    len = desc.bLength < err ? desc.bLength : err;
+    pushutf16(L, desc.bString, len > 1 ? (len - 2)/2 : 0);
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, cache, idx);
+    return 0;
+}
+
+static int lusb_get_string_descriptor_utf8(lua_State *L)
+{
+    libusb_device_handle *handle;
+    int idx, err;
+    handle = gethandle(L, 1);
+    idx = luaL_checkinteger(L, 2);
+    if (idx == 0)
+	return _err(L, LIBUSB_ERROR_INVALID_PARAM);
+    if ((err = getstring(L, handle, stringcache(L, 1), idx)) != 0)
+	return _err(L, err);
+    return 1;
+}
+
+/* strings for a list of indexes, nil for those that can't be read */
+static int lusb_get_strings(lua_State *L)
+{
+    libusb_device_handle *handle;
+    int cache, n, i, idx;
+    handle = gethandle(L, 1);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_settop(L, 2);
+    n = lua_rawlen(L, 2);
+    luaL_checkstack(L, n+4, NULL);
+    cache = stringcache(L, 1);
+    for (i = 1; i <= n; ++i)
+    {
+	lua_rawgeti(L, 2, i);
+	idx = lua_tointeger(L, -1);
+	lua_pop(L, 1);
+	if (idx <= 0 || getstring(L, handle, cache, idx) != 0)
+	    lua_pushnil(L);
+    }
+    return n;
+}
+
+static int lusb_open_device_with_vid_pid(lua_State *L)
+{
+    libusb_context *ctx;
+    libusb_device_handle **ud, *handle;
+    uint16_t vid, pid;
+    lua_settop(L, 3);
+    if (lua_isuserdata(L, 1))
+    {
+    	ctx = getctx(L, 1);
+    }
+    else
+    {
+	ctx = defctx(L);
+	lua_insert(L, 1);
+    }
+    vid = luaL_checkinteger(L, 2);
+    pid = luaL_checkinteger(L, 3);
+    ud = newhandle(L, 1);
+    handle = libusb_open_device_with_vid_pid(ctx, vid, pid);
+    /* the real error code is lost, just return NO_DEVICE every time */
+    if (handle == NULL)
+	return _err(L, LIBUSB_ERROR_NO_DEVICE);
+    *ud = handle;
+    return 1;
+}
+
+static int lusb_open(lua_State *L)
+{
+    libusb_device *dev;
+    libusb_device_handle **handle;
+    int err;
+    dev = getdev(L, 1);
+    handle = newhandle(L, 1);
+    if ((err = libusb_open(dev, handle)) != 0)
+	return _err(L, err);
+    return 1;
+}
+
+static int lusb_get_device(lua_State *L)
+{
+    libusb_device_handle *handle = gethandle(L, 1);
+    libusb_device *dev = libusb_get_device(handle);
+    newdev(L, 1, dev);
+    return 1;
+}
+
+#define FILTER_MAX	16
+#define FILTER_ANY	-1
+
+/* parsed find_devices filter */
+struct lusb_filter
+{
+    int nvid, npid, nport;
+    uint16_t vid[FILTER_MAX];
+    uint16_t pid[FILTER_MAX];
+    uint8_t port[FILTER_MAX];
+    int cls, subclass, protocol, bus;
+    const char *serial;
+};
+
+/* a number or a list of numbers */
+static int intlistfield(lua_State *L, int obj, const char *k,
+			void *out, size_t size, int narg)
+{
+    int i, n = 0, list;
+    lua_getfield(L, obj, k);
+    if (lua_isnumber(L, -1))
+	n = 1;
+    else if (lua_istable(L, -1))
+	n = lua_rawlen(L, -1);
+    if (n > FILTER_MAX)
+	luaL_argerror(L, narg, lua_pushfstring(L, "too many values for %s", k));
+    list = lua_istable(L, -1);
+    for (i = 0; i < n; ++i)
+    {
+	if (list)
+	    lua_rawgeti(L, -1, i+1);
+	else
+	    lua_pushvalue(L, -1);
+	if (size == sizeof(uint16_t))
+	    ((uint16_t*)out)[i] = lua_tointeger(L, -1);
+	else
+	    ((uint8_t*)out)[i] = lua_tointeger(L, -1);
+	lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+    return n;
+}
+
+static void checkfilter(lua_State *L, int ix, struct lusb_filter *f)
+{
+    memset(f, 0, sizeof(struct lusb_filter));
+    f->cls = f->subclass = f->protocol = f->bus = FILTER_ANY;
+    if (lua_isnoneornil(L, ix))
+	return;
+    luaL_checktype(L, ix, LUA_TTABLE);
+    f->nvid = intlistfield(L, ix, "vendor_id", f->vid, sizeof(uint16_t), ix);
+    f->npid = intlistfield(L, ix, "product_id", f->pid, sizeof(uint16_t), ix);
+    f->nport = intlistfield(L, ix, "port_path", f->port, sizeof(uint8_t), ix);
+    f->cls = optintfield(L, ix, "class", FILTER_ANY);
+    f->subclass = optintfield(L, ix, "subclass", FILTER_ANY);
+    f->protocol = optintfield(L, ix, "protocol", FILTER_ANY);
+    f->bus = optintfield(L, ix, "bus", FILTER_ANY);
+    lua_getfield(L, ix, "serial");
+    /* the filter table keeps the string alive */
+    f->serial = lua_isstring(L, -1) ? lua_tostring(L, -1) : NULL;
+    lua_pop(L, 1);
+#if !defined(LIBUSB_API_VERSION) || (LIBUSB_API_VERSION < 0x01000102)
+    if (f->nport > 0)
+	luaL_argerror(L, ix, "port_path is not supported");
+#endif
+}
+
+static int matchlist(const uint16_t *list, int n, uint16_t val)
+{
+    int i;
+    for (i = 0; i < n; ++i)
+	if (list[i] == val)
+	    return 1;
+    return n == 0;
+}
+
+/* everything but the serial number, which needs the device opened */
+static int matchdevice(libusb_device *dev, const struct lusb_filter *f,
+		       struct libusb_device_descriptor *desc)
+{
+    if (libusb_get_device_descriptor(dev, desc) != 0)
+	return 0;
+    if (!matchlist(f->vid, f->nvid, desc->idVendor)
+     || !matchlist(f->pid, f->npid, desc->idProduct))
+	return 0;
+    if ((f->cls != FILTER_ANY && f->cls != desc->bDeviceClass)
+     || (f->subclass != FILTER_ANY && f->subclass != desc->bDeviceSubClass)
+     || (f->protocol != FILTER_ANY && f->protocol != desc->bDeviceProtocol))
+	return 0;
+    if (f->bus != FILTER_ANY && f->bus != libusb_get_bus_number(dev))
+	return 0;
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000102)
+    if (f->nport > 0)
+    {
+	uint8_t port[FILTER_MAX];
+	int n = libusb_get_port_numbers(dev, port, FILTER_MAX);
+	if (n != f->nport || memcmp(port, f->port, n) != 0)
+	    return 0;
+    }
+#endif
+    if (f->serial != NULL && desc->iSerialNumber == 0)
+	return 0;
+    return 1;
+}
+
+/*
+ * Push the string at idx of the device object at ix, or nil. It comes
+ * from the cache when possible, else handle or a temporary one is used.
+ */
+static void pushdevstring(lua_State *L, int ix, libusb_device_handle *handle, int idx)
+{
+    libusb_device_handle *h = handle;
+    int cache;
+    ix = lua_absindex(L, ix);
+    cache = stringcache(L, ix);
+    lua_rawgeti(L, cache, idx);
+    if (lua_isnil(L, -1))
+    {
+	lua_pop(L, 1);
+	if (h == NULL && libusb_open(*(libusb_device**)lua_touserdata(L, ix), &h) != 0)
+	    lua_pushnil(L);
+	else
+	{
+	    if (getstring(L, h, cache, idx) != 0)
+		lua_pushnil(L);
+	    if (h != handle)
+		libusb_close(h);
+	}
+    }
+    lua_remove(L, cache);
+}
+
+static int matchserial(lua_State *L, int ix, const struct lusb_filter *f, int idx)
+{
+    int match;
+    if (f->serial == NULL)
+	return 1;
+    pushdevstring(L, ix, NULL, idx);
+    match = lua_isstring(L, -1) && strcmp(lua_tostring(L, -1), f->serial) == 0;
+    lua_pop(L, 1);
+    return match;
+}
+
+/*
+ * Devices matching a filter of vendor_id, product_id (numbers or lists),
+ * class, subclass, protocol, bus, port_path and serial.
+ */
+static int lusb_find_devices(lua_State *L)
+{
+    struct libusb_device_descriptor desc;
+    struct lusb_filter filter;
+    libusb_context *ctx;
+    libusb_device **devlist;
+    ssize_t numdevices, i;
+    int n = 0;
+    if (lua_isuserdata(L, 1))
+    {
+	ctx = getctx(L, 1);
+	lua_settop(L, 2);
+    }
+    else
+    {
+	lua_settop(L, 1);
+	ctx = defctx(L);
+	lua_insert(L, 1);
+    }
+    checkfilter(L, 2, &filter);
+    numdevices = libusb_get_device_list(ctx, &devlist);
+    if (numdevices < 0)
+	return _err(L, numdevices);
+    lua_newtable(L);
+    for (i = 0; i < numdevices; ++i)
+    {
+	if (!matchdevice(devlist[i], &filter, &desc))
+	    continue;
+	newdev(L, 1, devlist[i]);
+	if (matchserial(L, -1, &filter, desc.iSerialNumber))
+	    lua_rawseti(L, -2, ++n);
+	else
+	    lua_pop(L, 1);
+    }
+    libusb_free_device_list(devlist, 1);
     return 1;
 }
 
-static int lusb_open_device_with_vid_pid(lua_State *L)
+/*
+ * Open the first device matching a find_devices filter, or all of them
+ * as a list when the second argument is true.
+ */
+static int lusb_open_devices(lua_State *L)
 {
+    struct libusb_device_descriptor desc;
+    struct lusb_filter filter;
     libusb_context *ctx;
-    libusb_device_handle **ud, *handle;
-    uint16_t vid, pid;
-    lua_settop(L, 3);
+    libusb_device **devlist;
+    libusb_device_handle **handle;
+    ssize_t numdevices, i;
+    int all, match, n = 0, err = LIBUSB_ERROR_NO_DEVICE;
     if (lua_isuserdata(L, 1))
     {
-    	ctx = getctx(L, 1);
+	ctx = getctx(L, 1);
+	lua_settop(L, 3);
     }
     else
     {
+	lua_settop(L, 2);
 	ctx = defctx(L);
 	lua_insert(L, 1);
     }
-    vid = luaL_checkinteger(L, 2);
-    pid = luaL_checkinteger(L, 3);
-    ud = newhandle(L, 1);
-    handle = libusb_open_device_with_vid_pid(ctx, vid, pid);
-    /* the real error code is lost, just return NO_DEVICE every time */
-    if (handle == NULL)
-	return _err(L, LIBUSB_ERROR_NO_DEVICE);
-    *ud = handle;
-    return 1;
-}
-
-static int lusb_open(lua_State *L)
-{
-    libusb_device *dev;
-    libusb_device_handle **handle;
-    int err;
-    dev = getdev(L, 1);
-    handle = newhandle(L, 1);
-    if ((err = libusb_open(dev, handle)) != 0)
+    checkfilter(L, 2, &filter);
+    all = lua_toboolean(L, 3);
+    numdevices = libusb_get_device_list(ctx, &devlist);
+    if (numdevices < 0)
+	return _err(L, numdevices);
+    lua_newtable(L);
+    for (i = 0; i < numdevices; ++i)
+    {
+	if (!matchdevice(devlist[i], &filter, &desc))
+	    continue;
+	newdev(L, 1, devlist[i]);
+	if (filter.serial != NULL)
+	{
+	    /* skip devices with a known serial number without opening them */
+	    stringcache(L, -1);
+	    lua_rawgeti(L, -1, desc.iSerialNumber);
+	    match = !lua_isstring(L, -1) || strcmp(lua_tostring(L, -1), filter.serial) == 0;
+	    lua_pop(L, 2);
+	    if (!match)
+	    {
+		lua_pop(L, 1);
+		continue;
+	    }
+	}
+	handle = newhandle(L, -1);
+	if ((err = libusb_open(devlist[i], handle)) != 0)
+	{
+	    lua_pop(L, 2);
+	    continue;
+	}
+	if (filter.serial != NULL)
+	{
+	    pushdevstring(L, -2, *handle, desc.iSerialNumber);
+	    match = lua_isstring(L, -1) && strcmp(lua_tostring(L, -1), filter.serial) == 0;
+	    lua_pop(L, 1);
+	    if (!match)
+	    {
+		libusb_close(*handle);
+		*handle = INVALID_HANDLE;
+		err = LIBUSB_ERROR_NO_DEVICE;
+		lua_pop(L, 2);
+		continue;
+	    }
+	}
+	lua_remove(L, -2);
+	if (!all)
+	{
+	    libusb_free_device_list(devlist, 1);
+	    return 1;
+	}
+	lua_rawseti(L, -2, ++n);
+    }
+    libusb_free_device_list(devlist, 1);
+    if (!all)
 	return _err(L, err);
     return 1;
 }
 
-static int lusb_get_device(lua_State *L)
-{
-    libusb_device_handle *handle = gethandle(L, 1);
-    libusb_device *dev = libusb_get_device(handle);
-    newdev(L, 1, dev);
-    return 1;
-}
-
 static int lusb_get_configuration(lua_State *L)
 {
     libusb_device_handle *handle = gethandle(L, 1);
@@ -953,6 +2573,7 @@ static int lusb_set_configuration(lua_State *L)
     int cfg, err;
     handle = gethandle(L, 1);
     cfg = luaL_checkinteger(L, 2);
+    uncachedesc(L, handle);
     if ((err = libusb_set_configuration(handle, cfg)) != 0)
 	return _err(L, err);
     lua_settop(L, 1);
@@ -1008,11 +2629,67 @@ static int lusb_clear_halt(lua_State *L)
     return 1;
 }
 
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000103)
+/* a single endpoint or a list of them */
+static int endpointlist(lua_State *L, int narg, unsigned char *endpoints, int max)
+{
+    int i, n;
+    if (!lua_istable(L, narg))
+    {
+	endpoints[0] = luaL_checkinteger(L, narg);
+	return 1;
+    }
+    n = lua_rawlen(L, narg);
+    luaL_argcheck(L, n > 0 && n <= max, narg, "invalid number of endpoints");
+    for (i = 0; i < n; ++i)
+    {
+	lua_rawgeti(L, narg, i+1);
+	endpoints[i] = lua_tointeger(L, -1);
+	lua_pop(L, 1);
+    }
+    return n;
+}
+
+static int lusb_alloc_streams(lua_State *L)
+{
+    libusb_device_handle *handle;
+    unsigned char endpoints[32];
+    uint32_t num;
+    int n, err;
+    handle = gethandle(L, 1);
+    num = luaL_checkunsigned(L, 2);
+    n = endpointlist(L, 3, endpoints, sizeof(endpoints));
+    if ((err = libusb_alloc_streams(handle, num, endpoints, n)) < 0)
+	return _err(L, err);
+    lua_pushinteger(L, err);
+    return 1;
+}
+
+static int lusb_free_streams(lua_State *L)
+{
+    libusb_device_handle *handle;
+    unsigned char endpoints[32];
+    int n, err;
+    handle = gethandle(L, 1);
+    n = endpointlist(L, 2, endpoints, sizeof(endpoints));
+    if ((err = libusb_free_streams(handle, endpoints, n)) != 0)
+	return _err(L, err);
+    lua_settop(L, 1);
+    return 1;
+}
+#endif
+
 static int lusb_reset_device(lua_State *L)
 {
     libusb_device_handle *handle;
     int err;
     handle = gethandle(L, 1);
+    uncachedesc(L, handle);
+    lua_getfield(L, LUA_REGISTRYINDEX, STRINGS_REG);
+    pushdevobj(L, 1);
+    lua_pushnil(L);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
     if ((err = libusb_reset_device(handle)) != 0)
 	return _err(L, err);
     lua_settop(L, 1);
@@ -1055,6 +2732,289 @@ static int lusb_attach_kernel_driver(lua_State *L)
     return 1;
 }
 
+/* piece of a gather list, a string or a buffer */
+static const unsigned char* gatherpiece(lua_State *L, int list, int i, size_t *len)
+{
+    struct lusb_buffer *buf;
+    if ((buf = tobuffer(L, -1)) != NULL)
+    {
+	*len = buf->length;
+	return buf->data;
+    }
+    if (!lua_isstring(L, -1))
+	luaL_error(L, "bad argument #%d (string or buffer expected at index %d)", list, i);
+    return (const unsigned char*)lua_tolstring(L, -1, len);
+}
+
+static size_t gatherlen(lua_State *L, int list)
+{
+    size_t total = 0, len;
+    int i, n;
+    n = (int)luaL_len(L, list);
+    for (i = 1; i <= n; ++i)
+    {
+	lua_rawgeti(L, list, i);
+	gatherpiece(L, list, i, &len);
+	total += len;
+	lua_pop(L, 1);
+    }
+    return total;
+}
+
+static void gather(lua_State *L, int list, unsigned char *dest)
+{
+    const unsigned char *data;
+    size_t len;
+    int i, n;
+    n = (int)luaL_len(L, list);
+    for (i = 1; i <= n; ++i)
+    {
+	lua_rawgeti(L, list, i);
+	data = gatherpiece(L, list, i, &len);
+	memcpy(dest, data, len);
+	dest += len;
+	lua_pop(L, 1);
+    }
+}
+
+#define GATHER_WINDOW	4	/* chunk transfers in flight at once */
+
+/*
+ * Heap allocated so that transfers can outlive gathertransfer. The
+ * event thread may run the callbacks, so the shared fields are atomic.
+ * Every submitted transfer and gathertransfer itself hold a reference,
+ * whoever drops the last one frees the block.
+ */
+struct lusb_gather
+{
+    int refs;
+    int error;		/* first failed status */
+    int stop;		/* a chunk did not complete in full */
+    int completed;
+    int *done;		/* per chunk, set by the callback */
+    size_t n, chunk;
+    struct libusb_transfer **txs;
+    unsigned char *data;
+};
+
+static void freegather(struct lusb_gather *g)
+{
+    size_t i;
+    if (g->txs != NULL)
+	for (i = 0; i < g->n; ++i)
+	    if (g->txs[i] != NULL)
+		libusb_free_transfer(g->txs[i]);
+    free(g->txs);
+    free(g->done);
+    free(g->data);
+    free(g);
+}
+
+static void unrefgather(struct lusb_gather *g)
+{
+    if (l_atomic_add(&g->refs, -1) == 0)
+	freegather(g);
+}
+
+static void cancelgather(struct lusb_gather *g, size_t submitted)
+{
+    size_t i;
+    for (i = 0; i < submitted; ++i)
+	if (!l_atomic_load(&g->done[i]))
+	    libusb_cancel_transfer(g->txs[i]);
+}
+
+static void lusb_gather_cb_fn(struct libusb_transfer *tx)
+{
+    struct lusb_gather *g = (struct lusb_gather*)tx->user_data;
+    size_t i = (size_t)(tx->buffer - g->data) / g->chunk;
+    int zero = 0;
+    /* chunks are only cancelled after another one stopped the write */
+    if (tx->status != LIBUSB_TRANSFER_COMPLETED &&
+	tx->status != LIBUSB_TRANSFER_CANCELLED)
+	l_atomic_cas(&g->error, &zero, statuserr(tx->status));
+    if (tx->status != LIBUSB_TRANSFER_COMPLETED || tx->actual_length < tx->length)
+	l_atomic_store(&g->stop, 1);
+    l_atomic_store(&g->done[i], 1);
+    l_atomic_store(&g->completed, 1);
+    unrefgather(g);
+}
+
+/* submits chunk i with what is left of the deadline */
+static int submitchunk(struct lusb_gather *g, libusb_device_handle *handle,
+		       int endp, size_t len, size_t i, double deadline)
+{
+    unsigned int timeout = 0;
+    int err;
+    if (deadline > 0)
+    {
+	double left = (deadline - monotime()) * 1000;
+	if (left < 1)
+	    return LIBUSB_ERROR_TIMEOUT;
+	timeout = (unsigned int)left;
+    }
+    if ((g->txs[i] = libusb_alloc_transfer(0)) == NULL)
+	return LIBUSB_ERROR_NO_MEM;
+    libusb_fill_bulk_transfer(g->txs[i], handle, endp, g->data + i*g->chunk,
+			      (i == g->n-1) ? len - i*g->chunk : g->chunk,
+			      lusb_gather_cb_fn, g, timeout);
+    l_atomic_add(&g->refs, 1);
+    if ((err = libusb_submit_transfer(g->txs[i])) != 0)
+    {
+	l_atomic_add(&g->refs, -1);
+	l_atomic_store(&g->done[i], 1);
+	g->txs[i]->status = LIBUSB_TRANSFER_ERROR;
+	g->txs[i]->actual_length = 0;
+    }
+    return err;
+}
+
+/*
+ * Writes the list at index 3 split on max packet boundaries into
+ * transfers of at most chunk bytes, GATHER_WINDOW of them in flight.
+ * The timeout covers the whole write. Nothing is submitted after a
+ * chunk fails and only the bytes written in order are reported.
+ */
+static int gathertransfer(lua_State *L, libusb_device_handle *handle,
+			  int endp, unsigned int timeout, size_t chunk)
+{
+    struct lusb_gather *g;
+    unsigned char *data;
+    libusb_context *ctx;
+    size_t len, i, next;
+    int err, mps, cancelled, actual, error;
+    double deadline;
+    len = gatherlen(L, 3);
+    if ((data = (unsigned char*)malloc(len > 0 ? len : 1)) == NULL)
+	return _err(L, LIBUSB_ERROR_NO_MEM);
+    gather(L, 3, data);
+    mps = libusb_get_max_packet_size(libusb_get_device(handle), endp);
+    if (chunk > 0 && mps > 0)
+    {
+	chunk -= chunk % mps;
+	if (chunk == 0)
+	    chunk = mps;
+    }
+    if (chunk == 0 || chunk >= len)
+    {
+	actual = 0;
+	err = libusb_bulk_transfer(handle, endp, data, len, &actual, timeout);
+	free(data);
+	countsync(L, 1, endp, err, actual);
+	if (err < 0 && err != LIBUSB_ERROR_TIMEOUT)
+	    return _err(L, err);
+	lua_pushinteger(L, actual);
+	lua_pushboolean(L, err == LIBUSB_ERROR_TIMEOUT);
+	return 2;
+    }
+    if ((g = (struct lusb_gather*)calloc(1, sizeof(struct lusb_gather))) == NULL)
+    {
+	free(data);
+	return _err(L, LIBUSB_ERROR_NO_MEM);
+    }
+    g->refs = 1;
+    g->data = data;
+    g->chunk = chunk;
+    g->n = (len + chunk - 1) / chunk;
+    g->txs = (struct libusb_transfer**)calloc(g->n, sizeof(struct libusb_transfer*));
+    g->done = (int*)calloc(g->n, sizeof(int));
+    if (g->txs == NULL || g->done == NULL)
+    {
+	freegather(g);
+	return _err(L, LIBUSB_ERROR_NO_MEM);
+    }
+    deadline = timeout > 0 ? monotime() + timeout / 1000.0 : 0;
+    ctx = handlectx(L, 1);
+    next = 0;
+    cancelled = 0;
+    error = 0;
+    for (;;)
+    {
+	while (next < g->n && error == 0 && !l_atomic_load(&g->stop) &&
+	       l_atomic_load(&g->refs) - 1 < GATHER_WINDOW)
+	{
+	    if ((err = submitchunk(g, handle, endp, len, next, deadline)) != 0)
+		error = err;
+	    ++next;
+	}
+	if (l_atomic_load(&g->refs) == 1)
+	    break;
+	if ((error != 0 || l_atomic_load(&g->stop)) && !cancelled)
+	{
+	    cancelgather(g, next);
+	    cancelled = 1;
+	}
+	l_atomic_store(&g->completed, 0);
+	err = libusb_handle_events_completed(ctx, &g->completed);
+	if (err != 0 && err != LIBUSB_ERROR_INTERRUPTED)
+	{
+	    if (error == 0)
+		error = err;
+	    if (!cancelled)
+		cancelgather(g, next);
+	    /* can't wait here, the last callback frees the block */
+	    break;
+	}
+    }
+    /* the contiguous prefix of chunks that completed in full */
+    actual = 0;
+    for (i = 0; i < next && l_atomic_load(&g->done[i]); ++i)
+    {
+	actual += g->txs[i]->actual_length;
+	if (g->txs[i]->status != LIBUSB_TRANSFER_COMPLETED ||
+	    g->txs[i]->actual_length < g->txs[i]->length)
+	    break;
+    }
+    if (l_atomic_load(&g->error) != 0)
+	error = l_atomic_load(&g->error);
+    unrefgather(g);
+    countsync(L, 1, endp, error, actual);
+    if (error != 0 && error != LIBUSB_ERROR_TIMEOUT)
+	return _err(L, error);
+    lua_pushinteger(L, actual);
+    lua_pushboolean(L, error == LIBUSB_ERROR_TIMEOUT);
+    return 2;
+}
+
+static int lusb_dev_mem_alloc(lua_State *L)
+{
+    libusb_device_handle *handle;
+    struct lusb_buffer *buf;
+    size_t len;
+    handle = gethandle(L, 1);
+    len = luaL_checkunsigned(L, 2);
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+    {
+	unsigned char *mem = libusb_dev_mem_alloc(handle, len);
+	if (mem != NULL)
+	{
+	    buf = (struct lusb_buffer*)lua_newuserdata(L, sizeof(struct lusb_buffer));
+	    buf->data = mem;
+	    buf->length = len;
+	    buf->devmem = (struct lusb_handle_ud*)lua_touserdata(L, 1);
+	    ++buf->devmem->users;
+	    luaL_getmetatable(L, BUFFER_MT);
+	    lua_setmetatable(L, -2);
+	    /* the handle must outlive the mapping */
+	    lua_getfield(L, LUA_REGISTRYINDEX, HANDLES_REG);
+	    lua_pushvalue(L, -2);
+	    lua_pushvalue(L, 1);
+	    lua_rawset(L, -3);
+	    lua_pop(L, 1);
+	    lua_pushboolean(L, 1);
+	    return 2;
+	}
+    }
+#else
+    (void)handle;
+#endif
+    /* not supported, use ordinary memory */
+    buf = newbuffer(L, len);
+    memset(buf->data, 0, len);
+    lua_pushboolean(L, 0);
+    return 2;
+}
+
 static int lusb_control_transfer(lua_State *L)
 {
     luaL_Buffer buffer;
@@ -1078,6 +3038,7 @@ static int lusb_control_transfer(lua_State *L)
 	data = (unsigned char*)luaL_prepbuffsize(&buffer, len);
 	err = libusb_control_transfer(handle, reqt, req, val, idx,
 				      data, len, timeout);
+	countsync(L, 1, reqt & LIBUSB_ENDPOINT_DIR_MASK, err, err);
 	if (err < 0)
 	    return _err(L, err);
 	luaL_addbuffsize(&buffer, err);
@@ -1089,6 +3050,7 @@ static int lusb_control_transfer(lua_State *L)
 	data = (unsigned char*)luaL_checklstring(L, 6, &len);
 	err = libusb_control_transfer(handle, reqt, req, val, idx,
 				      data, len, timeout);
+	countsync(L, 1, reqt & LIBUSB_ENDPOINT_DIR_MASK, err, err);
 	if (err < 0)
 	    return _err(L, err);
 	lua_pushinteger(L, err);
@@ -1105,7 +3067,7 @@ static int lusb_bulk_transfer(lua_State *L)
     unsigned char *data;
     size_t len;
     unsigned int timeout;
-    lua_settop(L, 4);
+    lua_settop(L, 5);
     handle = gethandle(L, 1);
     endp = luaL_checkinteger(L, 2);
     timeout = luaL_optunsigned(L, 4, 0);
@@ -1116,6 +3078,7 @@ static int lusb_bulk_transfer(lua_State *L)
 	data = (unsigned char*)luaL_prepbuffsize(&buffer, len);
 	err = libusb_bulk_transfer(handle, endp, data, len,
 				   (int*)&len, timeout);
+	countsync(L, 1, endp, err, len);
 	if (err < 0 && err != LIBUSB_ERROR_TIMEOUT)
 	    return _err(L, err);
 	luaL_addbuffsize(&buffer, len);
@@ -1125,9 +3088,13 @@ static int lusb_bulk_transfer(lua_State *L)
     }
     else /* LIBUSB_ENDPOINT_OUT */
     {
+	if (lua_istable(L, 3))
+	    return gathertransfer(L, handle, endp, timeout,
+				  luaL_optunsigned(L, 5, 0));
 	data = (unsigned char*)luaL_checklstring(L, 3, &len);
 	err = libusb_bulk_transfer(handle, endp, data, len,
 				   (int*)&len, timeout);
+	countsync(L, 1, endp, err, len);
 	if (err < 0 && err != LIBUSB_ERROR_TIMEOUT)
 	    return _err(L, err);
 	lua_pushinteger(L, len);
@@ -1156,6 +3123,7 @@ static int lusb_interrupt_transfer(lua_State *L)
 	data = (unsigned char*)luaL_prepbuffsize(&buffer, len);
 	err = libusb_interrupt_transfer(handle, endp, data, len,
 					(int*)&len, timeout);
+	countsync(L, 1, endp, err, len);
 	if (err < 0 && err != LIBUSB_ERROR_TIMEOUT)
 	    return _err(L, err);
 	luaL_addbuffsize(&buffer, len);
@@ -1168,6 +3136,7 @@ static int lusb_interrupt_transfer(lua_State *L)
 	data = (unsigned char*)luaL_checklstring(L, 3, &len);
 	err = libusb_interrupt_transfer(handle, endp, data, len,
 					(int*)&len, timeout);
+	countsync(L, 1, endp, err, len);
 	if (err < 0 && err != LIBUSB_ERROR_TIMEOUT)
 	    return _err(L, err);
 	lua_pushinteger(L, len);
@@ -1177,26 +3146,294 @@ static int lusb_interrupt_transfer(lua_State *L)
     return 0; /* make compiler happy */
 }
 
+/* buffer[, start[, length]] arguments, start is a 1-based index like
+ * every other buffer method and negative values count from the end */
+static unsigned char* bufferargs(lua_State *L, int narg, size_t *len)
+{
+    struct lusb_buffer *buf;
+    lua_Integer i;
+    size_t offset;
+    buf = getbuffer(L, narg);
+    i = luaL_optinteger(L, narg+1, 1);
+    if (i < 0)
+	i = (lua_Integer)buf->length + i + 1;
+    luaL_argcheck(L, i >= 1 && i <= (lua_Integer)buf->length + 1, narg+1,
+		  "index out of range");
+    offset = (size_t)(i - 1);
+    *len = luaL_optunsigned(L, narg+2, buf->length - offset);
+    luaL_argcheck(L, *len <= buf->length - offset, narg+2, "length out of range");
+    return buf->data + offset;
+}
+
+/* reads into or writes from a buffer, returns only the length */
+static int buffertransfer(lua_State *L,
+			  int (LIBUSB_CALL *fn)(libusb_device_handle*, unsigned char,
+				    unsigned char*, int, int*, unsigned int))
+{
+    libusb_device_handle *handle;
+    int endp, err, actual;
+    unsigned char *data;
+    size_t len;
+    unsigned int timeout;
+    lua_settop(L, 6);
+    handle = gethandle(L, 1);
+    endp = luaL_checkinteger(L, 2);
+    data = bufferargs(L, 3, &len);
+    timeout = luaL_optunsigned(L, 6, 0);
+    actual = 0;
+    err = fn(handle, endp, data, len, &actual, timeout);
+    countsync(L, 1, endp, err, actual);
+    if (err < 0 && err != LIBUSB_ERROR_TIMEOUT)
+	return _err(L, err);
+    lua_pushinteger(L, actual);
+    lua_pushboolean(L, err == LIBUSB_ERROR_TIMEOUT);
+    return 2;
+}
+
+static int lusb_bulk_transfer_buffer(lua_State *L)
+{
+    return buffertransfer(L, libusb_bulk_transfer);
+}
+
+static int lusb_interrupt_transfer_buffer(lua_State *L)
+{
+    return buffertransfer(L, libusb_interrupt_transfer);
+}
+
+static void pushcounters(lua_State *L, struct lusb_counters *c)
+{
+    lua_createtable(L, 0, 9);
+    lua_pushnumber(L, (lua_Number)l_atomic_load(&c->bytes_in));
+    lua_setfield(L, -2, "bytes_in");
+    lua_pushnumber(L, (lua_Number)l_atomic_load(&c->bytes_out));
+    lua_setfield(L, -2, "bytes_out");
+    lua_pushnumber(L, (lua_Number)l_atomic_load(&c->completed));
+    lua_setfield(L, -2, "completed");
+    lua_pushnumber(L, (lua_Number)l_atomic_load(&c->timeouts));
+    lua_setfield(L, -2, "timeouts");
+    lua_pushnumber(L, (lua_Number)l_atomic_load(&c->stalls));
+    lua_setfield(L, -2, "stalls");
+    lua_pushnumber(L, (lua_Number)l_atomic_load(&c->overflows));
+    lua_setfield(L, -2, "overflows");
+    lua_pushnumber(L, (lua_Number)l_atomic_load(&c->cancelled));
+    lua_setfield(L, -2, "cancelled");
+    lua_pushnumber(L, (lua_Number)l_atomic_load(&c->no_device));
+    lua_setfield(L, -2, "no_device");
+    lua_pushnumber(L, (lua_Number)l_atomic_load(&c->errors));
+    lua_setfield(L, -2, "errors");
+}
+
+/* counters of one endpoint, or the totals with an endpoints table */
+static int lusb_handle_stats(lua_State *L)
+{
+    struct lusb_handle_ud *ud;
+    struct lusb_counters *c;
+    int i, ep;
+    ud = (struct lusb_handle_ud*)luaL_checkudata(L, 1, HANDLE_MT);
+    if (!lua_isnoneornil(L, 2))
+    {
+	ep = luaL_checkinteger(L, 2);
+	pushcounters(L, &ud->counters[EPINDEX(ep)]);
+	return 1;
+    }
+    pushcounters(L, &ud->total);
+    lua_newtable(L);
+    for (i = 0; i < ENDPOINT_SLOTS; ++i)
+    {
+	c = &ud->counters[i];
+	/* every transfer bumps exactly one outcome */
+	if (l_atomic_load(&c->completed) + l_atomic_load(&c->timeouts) +
+	    l_atomic_load(&c->stalls) + l_atomic_load(&c->overflows) +
+	    l_atomic_load(&c->cancelled) + l_atomic_load(&c->no_device) +
+	    l_atomic_load(&c->errors) == 0)
+	    continue;
+	pushcounters(L, c);
+	lua_rawseti(L, -2, EPADDRESS(i));
+    }
+    lua_setfield(L, -2, "endpoints");
+    return 1;
+}
+
+static int lusb_ctx_stats(lua_State *L)
+{
+    pushcounters(L, &getctxud(L, 1)->counters);
+    return 1;
+}
+
+/* upper edge of the bucket holding the q quantile, in seconds */
+static double latencyquantile(const unsigned int *bucket, unsigned int count,
+			      unsigned int max, double q)
+{
+    unsigned long long rank, seen = 0;
+    double edge;
+    int b;
+    rank = (unsigned long long)(q * count + 0.999999);
+    if (rank == 0)
+	rank = 1;
+    for (b = 0; b < LATENCY_BUCKETS - 1; ++b)
+    {
+	seen += bucket[b];
+	if (seen >= rank)
+	    break;
+    }
+    edge = (double)(1ULL << b);
+    return (edge < max ? edge : max) / 1e6;
+}
+
+static void pushlatency(lua_State *L, struct lusb_latency *lat)
+{
+    unsigned int bucket[LATENCY_BUCKETS], count = 0, min, max;
+    int b;
+    /* snapshot first, completions may arrive meanwhile */
+    for (b = 0; b < LATENCY_BUCKETS; ++b)
+	count += bucket[b] = l_atomic_load(&lat->bucket[b]);
+    min = l_atomic_load(&lat->min);
+    max = l_atomic_load(&lat->max);
+    lua_createtable(L, 0, 8);
+    lua_pushinteger(L, count);
+    lua_setfield(L, -2, "count");
+    lua_createtable(L, LATENCY_BUCKETS, 0);
+    for (b = 0; b < LATENCY_BUCKETS; ++b)
+    {
+	lua_pushinteger(L, bucket[b]);
+	lua_rawseti(L, -2, b+1);
+    }
+    lua_setfield(L, -2, "buckets");
+    /* a completion may be counted before it updates min and max */
+    if (count == 0 || min > max)
+	return;
+    lua_pushnumber(L, min / 1e6);
+    lua_setfield(L, -2, "min");
+    lua_pushnumber(L, max / 1e6);
+    lua_setfield(L, -2, "max");
+    lua_pushnumber(L, l_atomic_load(&lat->sum) / 1e6 / count);
+    lua_setfield(L, -2, "mean");
+    lua_pushnumber(L, latencyquantile(bucket, count, max, 0.5));
+    lua_setfield(L, -2, "p50");
+    lua_pushnumber(L, latencyquantile(bucket, count, max, 0.99));
+    lua_setfield(L, -2, "p99");
+    lua_pushnumber(L, latencyquantile(bucket, count, max, 0.999));
+    lua_setfield(L, -2, "p999");
+}
+
+/* async completion latency of one endpoint, or of all that have any */
+static int lusb_latency_stats(lua_State *L)
+{
+    struct lusb_handle_ud *ud;
+    int i, ep;
+    ud = (struct lusb_handle_ud*)luaL_checkudata(L, 1, HANDLE_MT);
+    if (!lua_isnoneornil(L, 2))
+    {
+	ep = luaL_checkinteger(L, 2);
+	pushlatency(L, &ud->latency[EPINDEX(ep)]);
+	return 1;
+    }
+    lua_newtable(L);
+    for (i = 0; i < ENDPOINT_SLOTS; ++i)
+    {
+	if (l_atomic_load(&ud->latency[i].count) == 0)
+	    continue;
+	pushlatency(L, &ud->latency[i]);
+	lua_rawseti(L, -2, EPADDRESS(i));
+    }
+    return 1;
+}
+
+static int lusb_reset_latency_stats(lua_State *L)
+{
+    struct lusb_handle_ud *ud;
+    int i, ep;
+    ud = (struct lusb_handle_ud*)luaL_checkudata(L, 1, HANDLE_MT);
+    if (!lua_isnoneornil(L, 2))
+    {
+	ep = luaL_checkinteger(L, 2);
+	resetlatency(&ud->latency[EPINDEX(ep)]);
+    }
+    else
+	for (i = 0; i < ENDPOINT_SLOTS; ++i)
+	    resetlatency(&ud->latency[i]);
+    lua_settop(L, 1);
+    return 1;
+}
+
+/* what a coroutine waiting on a transfer is resumed with */
+#define AWAIT_STATUS	0	/* status, actual_length */
+#define AWAIT_DATA	1	/* received data or nil, error */
+
 struct lusb_transfer_cb_ud
 {
+    struct lusb_event ev;	/* must come first */
     lua_State *L;
+    struct libusb_transfer *tx;
+    struct lusb_transfer_ud *txud;
+    struct lusb_context_ud *owner;
     int ref;
+    int await;
+    int completed;
+    int deferred;	/* resume on the Lua thread once libusb returns */
+    int posted;		/* goes to the queue, set before completed */
 };
 
-static void lusb_transfer_cb_fn(struct libusb_transfer *tx)
+/* the thread callbacks run on, a coroutine may be dead by then */
+static lua_State* mainthread(lua_State *L)
+{
+    lua_State *T;
+#if LUA_VERSION_NUM>=502
+    lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+#else
+    lua_getfield(L, LUA_REGISTRYINDEX, MAINTHREAD_REG);
+#endif
+    T = lua_tothread(L, -1);
+    lua_pop(L, 1);
+    return T != NULL ? T : L;
+}
+
+static int pushawait(lua_State *L, struct libusb_transfer *tx, int await)
+{
+    int err;
+    if (await == AWAIT_DATA)
+    {
+	if ((err = statuserr(tx->status)) != 0)
+	    return _err(L, err);
+	lua_pushlstring(L, (char*)tx->buffer, tx->actual_length);
+	return 1;
+    }
+    lua_pushinteger(L, tx->status);
+    lua_pushinteger(L, tx->actual_length);
+    return 2;
+}
+
+/* returns non-zero with the message pushed if a coroutine failed */
+static int transferdone(lua_State *L, struct libusb_transfer *tx, int ref, int await)
 {
-    lua_State *L = ((struct lusb_transfer_cb_ud*)tx->user_data)->L;
-    int base;
-    if (!lua_checkstack(L, 6))
-	return;
+    int base, status, failed = 0;
+    if (!lua_checkstack(L, 7))
+	return 0;
     base = lua_gettop(L);
+    lua_pushnil(L);	/* error message slot */
     lua_getfield(L, LUA_REGISTRYINDEX, TRANSFER_REG);
-    lua_rawgeti(L, -1, ((struct lusb_transfer_cb_ud*)tx->user_data)->ref);
+    lua_rawgeti(L, -1, ref);
     if (!lua_isnil(L, -1))
     {
 	/* { callback, transfer, ud } */
 	lua_rawgeti(L, -1, 1);
-	if (!lua_isnil(L, -1))
+	if (lua_isthread(L, -1))
+	{
+	    /* wake the coroutine waiting in await */
+	    lua_State *co = lua_tothread(L, -1);
+	    if (lua_status(co) == LUA_YIELD && lua_checkstack(co, 3))
+	    {
+		status = l_resume(co, L, pushawait(co, tx, await));
+		if (status != 0 && status != LUA_YIELD)
+		{
+		    lua_xmove(co, L, 1);
+		    lua_replace(L, base+1);
+		    failed = 1;
+		}
+	    }
+	    lua_pop(L, 1);
+	}
+	else if (!lua_isnil(L, -1))
 	{
 	    lua_rawgeti(L, -2, 2);
 	    lua_pushinteger(L, tx->status);
@@ -1209,10 +3446,82 @@ static void lusb_transfer_cb_fn(struct libusb_transfer *tx)
 	    lua_pop(L, 1);
 	}
 	lua_pop(L, 1);
-	lua_pushnil(L);
-	lua_rawseti(L, -2, ((struct lusb_transfer_cb_ud*)tx->user_data)->ref);
+	luaL_unref(L, -1, ref);
     }
-    lua_settop(L, base);
+    lua_settop(L, failed ? base+1 : base);
+    return failed;
+}
+
+/* queued events only run on the Lua thread, outside of libusb */
+static void lusb_transfer_dispatch(lua_State *L, struct lusb_event *ev)
+{
+    struct lusb_transfer_cb_ud *ud = (struct lusb_transfer_cb_ud*)ev;
+    if (transferdone(L, ud->tx, ud->ref, ud->await))
+	lua_error(L);
+}
+
+/* callbacks for one context never run concurrently, only reset races */
+static void recordlatency(struct lusb_latency *lat, double secs)
+{
+    double us = secs * 1e6;
+    unsigned int v, b, old;
+    v = us <= 0 ? 0 : us >= 4294967295.0 ? 0xffffffffu : (unsigned int)us;
+    b = v == 0 ? 0 : 32 - __builtin_clz(v);
+    if (b >= LATENCY_BUCKETS)
+	b = LATENCY_BUCKETS - 1;
+    l_atomic_add(&lat->bucket[b], 1);
+    l_atomic_add(&lat->count, 1);
+    l_atomic_add(&lat->sum, v);
+    /* the event thread and reset_latency_stats both write min and max */
+    old = l_atomic_load(&lat->min);
+    while (v < old && !l_atomic_cas(&lat->min, &old, v))
+	;
+    old = l_atomic_load(&lat->max);
+    while (v > old && !l_atomic_cas(&lat->max, &old, v))
+	;
+}
+
+static void lusb_transfer_cb_fn(struct libusb_transfer *tx)
+{
+    struct lusb_transfer_cb_ud *ud = (struct lusb_transfer_cb_ud*)tx->user_data;
+    ud->txud->completed = monotime();
+    if (ud->txud->handle != NULL)
+    {
+	int ep = tx->endpoint, len = tx->actual_length, i;
+	if (tx->type == LIBUSB_TRANSFER_TYPE_CONTROL)
+	    ep = tx->buffer[0] & LIBUSB_ENDPOINT_DIR_MASK;
+	else if (tx->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS)
+	    for (len = 0, i = 0; i < tx->num_iso_packets; ++i)
+		len += tx->iso_packet_desc[i].actual_length;
+	counttransfer(ud->txud->handle, ep, tx->status, len);
+	/* a cancelled transfer says nothing about the device */
+	if (tx->status != LIBUSB_TRANSFER_CANCELLED)
+	    recordlatency(&ud->txud->handle->latency[EPINDEX(ep)],
+			  ud->txud->completed - ud->txud->submitted);
+    }
+    l_atomic_store(&ud->txud->active, 0);
+    /* never call into Lua from the event thread, and don't run
+       coroutines inside libusb where they can't make sync calls */
+    if (ud->owner != NULL && (ud->owner->threaded || ud->deferred))
+    {
+	/* await sees posted with completed and takes the event back */
+	ud->posted = 1;
+	l_atomic_store(&ud->completed, 1);
+	postevent(ud->owner, &ud->ev);
+    }
+    else
+    {
+	l_atomic_store(&ud->completed, 1);
+	if (transferdone(ud->L, tx, ud->ref, ud->await))
+	    lua_pop(ud->L, 1);	/* can't raise from inside libusb */
+    }
+}
+
+static void lusb_transfer_discard(lua_State *L, struct lusb_event *ev)
+{
+    lua_getfield(L, LUA_REGISTRYINDEX, TRANSFER_REG);
+    luaL_unref(L, -1, ((struct lusb_transfer_cb_ud*)ev)->ref);
+    lua_pop(L, 1);
 }
 
 static struct lusb_transfer_cb_ud* callback(lua_State *L, int tx, int cb)
@@ -1226,38 +3535,248 @@ static struct lusb_transfer_cb_ud* callback(lua_State *L, int tx, int cb)
     lua_rawseti(L, -4, 1);
     lua_rawseti(L, -3, 2);
     lua_rawseti(L, -2, 3);
-    ud->ref = (int)lua_rawlen(L, -2) + 1;
-    ud->L = L;
-    lua_rawseti(L, -2, ud->ref);
+    /* luaL_ref keeps a free list of released slots */
+    ud->ref = luaL_ref(L, -2);
+    ud->L = mainthread(L);
+    ud->txud = (struct lusb_transfer_ud*)lua_touserdata(L, tx);
+    ud->tx = ud->txud->tx;
+    ud->await = AWAIT_STATUS;
+    ud->completed = 0;
+    ud->deferred = 0;
+    ud->posted = 0;
+    ud->ev.dispatch = lusb_transfer_dispatch;
+    ud->ev.discard = lusb_transfer_discard;
     lua_pop(L, 1);
+    lua_getfield(L, LUA_REGISTRYINDEX, HANDLES_REG);
+    lua_pushvalue(L, tx);
+    lua_rawget(L, -2);
+    ud->owner = handlectxud(L, -1);
+    lua_pop(L, 2);
     return ud;
 }
 
-static int lusb_transfer(lua_State *L)
+static void uncallback(lua_State *L, struct lusb_transfer_cb_ud *ud)
 {
-    struct libusb_transfer **tx;
-    int num = luaL_optinteger(L, 1, 0);
-    tx = (struct libusb_transfer**)lua_newuserdata(L, sizeof(struct libusb_transfer*));
-    *tx = INVALID_TRANSFER;
+    lua_getfield(L, LUA_REGISTRYINDEX, TRANSFER_REG);
+    luaL_unref(L, -1, ud->ref);
+    lua_pop(L, 1);
+}
+
+static struct lusb_transfer_ud* newtransfer(lua_State *L, int num)
+{
+    struct lusb_transfer_ud *ud;
+    ud = (struct lusb_transfer_ud*)lua_newuserdata(L, sizeof(struct lusb_transfer_ud));
+    ud->tx = INVALID_TRANSFER;
+    ud->flags = 0;
+    ud->cbuf = NULL;
+    ud->csize = 0;
+    ud->active = 0;
+    ud->submitted = ud->completed = 0;
+    ud->handle = NULL;
     luaL_getmetatable(L, TRANSFER_MT);
     lua_setmetatable(L, -2);
-    *tx = libusb_alloc_transfer(num);
-    if (*tx == NULL)
+    ud->tx = libusb_alloc_transfer(num);
+    return ud;
+}
+
+static int lusb_transfer(lua_State *L)
+{
+    int num = luaL_optinteger(L, 1, 0);
+    if (newtransfer(L, num)->tx == NULL)
 	return _err(L, LIBUSB_ERROR_NO_MEM);
     return 1;
 }
 
-static int lusb_submit_transfer(lua_State *L)
+static int submittransfer(lua_State *L, int transferidx, int cbidx)
 {
+    struct lusb_transfer_ud *ud;
     struct libusb_transfer *tx;
+    void *olddata;
+    double submitted, completed;
     int err;
+    ud = (struct lusb_transfer_ud*)lua_touserdata(L, transferidx);
+    tx = ud->tx;
+    /* the pending completion still owns user_data */
+    if (l_atomic_load(&ud->active))
+	return LIBUSB_ERROR_BUSY;
+    olddata = tx->user_data;
+    submitted = ud->submitted;
+    completed = ud->completed;
+    tx->user_data = callback(L, transferidx, cbidx);
+    tx->callback = lusb_transfer_cb_fn;
+    /* set before submitting, the event thread may complete it at once */
+    ud->submitted = monotime();
+    ud->completed = 0;
+    l_atomic_store(&ud->active, 1);
+    err = libusb_submit_transfer(tx);
+    if (err != 0)
+    {
+	l_atomic_store(&ud->active, 0);
+	ud->submitted = submitted;
+	ud->completed = completed;
+	uncallback(L, (struct lusb_transfer_cb_ud*)tx->user_data);
+	tx->user_data = olddata;
+    }
+    return err;
+}
+
+static int lusb_submit_transfer(lua_State *L)
+{
+    struct libusb_transfer *tx;
     lua_settop(L, 3);
     tx = gettransfer(L, 1);
     tx->timeout = luaL_optunsigned(L, 3, 0);
-    tx->user_data = callback(L, 1, 2);
-    tx->callback = lusb_transfer_cb_fn;
-    err = libusb_submit_transfer(tx);
-    return _err(L, err);
+    /* remember the callback for resubmit_transfer */
+    lua_getfield(L, LUA_REGISTRYINDEX, CALLBACK_REG);
+    lua_pushvalue(L, 1);
+    lua_pushvalue(L, 2);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+    return _err(L, submittransfer(L, 1, 2));
+}
+
+static int lusb_resubmit_transfer(lua_State *L)
+{
+    struct libusb_transfer *tx;
+    lua_settop(L, 2);
+    tx = gettransfer(L, 1);
+    if (!lua_isnil(L, 2))
+	tx->timeout = luaL_checkunsigned(L, 2);
+    if (tx->buffer == NULL)
+	return luaL_error(L, "transfer buffer has not been created");
+    lua_getfield(L, LUA_REGISTRYINDEX, CALLBACK_REG);
+    lua_pushvalue(L, 1);
+    lua_rawget(L, -2);
+    return _err(L, submittransfer(L, 1, 4));
+}
+
+/*
+ * Submit and wait for the transfer. A coroutine yields and is resumed by
+ * the completion, the main thread handles events until it's done.
+ * Coroutines are only resumed by handle_events, handle_events_timeout
+ * and dispatch, not by the lower level event loop functions.
+ */
+static int awaittransfer(lua_State *L, int transferidx, int await)
+{
+    struct libusb_transfer *tx;
+    struct lusb_transfer_cb_ud *ud;
+    libusb_context *ctx;
+    int err, cancelled = 0;
+    transferidx = lua_absindex(L, transferidx);
+    tx = *(struct libusb_transfer**)lua_touserdata(L, transferidx);
+    if (!lua_pushthread(L))
+    {
+	if ((err = submittransfer(L, transferidx, lua_gettop(L))) != 0)
+	    return _err(L, err);
+	ud = (struct lusb_transfer_cb_ud*)tx->user_data;
+	ud->await = await;
+	ud->deferred = 1;
+	return lua_yield(L, 0);
+    }
+    lua_pushnil(L);
+    if ((err = submittransfer(L, transferidx, lua_gettop(L))) != 0)
+	return _err(L, err);
+    ud = (struct lusb_transfer_cb_ud*)tx->user_data;
+    /* keep ud alive until we're done with it */
+    lua_getfield(L, LUA_REGISTRYINDEX, TRANSFER_REG);
+    lua_rawgeti(L, -1, ud->ref);
+    ctx = ud->owner != NULL ? ud->owner->ctx : NULL;
+    while (!l_atomic_load(&ud->completed))
+    {
+	err = libusb_handle_events_completed(ctx, &ud->completed);
+	if (err != 0 && err != LIBUSB_ERROR_INTERRUPTED)
+	{
+	    if (cancelled)
+		return _err(L, err);
+	    libusb_cancel_transfer(tx);
+	    cancelled = 1;
+	}
+    }
+    /* release only the entry the event thread queued for us, other
+       completions wait for handle_events or dispatch */
+    if (ud->posted)
+    {
+	takeevent(ud->owner, &ud->ev);
+	ud->ev.dispatch(L, &ud->ev);
+    }
+    return pushawait(L, tx, await);
+}
+
+static int lusb_transfer_await(lua_State *L)
+{
+    struct libusb_transfer *tx;
+    lua_settop(L, 2);
+    tx = gettransfer(L, 1);
+    if (!lua_isnil(L, 2))
+	tx->timeout = luaL_checkunsigned(L, 2);
+    if (tx->buffer == NULL)
+	return luaL_error(L, "transfer buffer has not been created");
+    return awaittransfer(L, 1, AWAIT_STATUS);
+}
+
+static int lusb_set_reuse_buffer(lua_State *L)
+{
+    struct lusb_transfer_ud *ud;
+    gettransfer(L, 1);
+    ud = (struct lusb_transfer_ud*)lua_touserdata(L, 1);
+    if (lua_isnone(L, 2) || lua_toboolean(L, 2))
+	ud->flags |= TRANSFER_REUSE_BUFFER;
+    else
+	ud->flags &= ~TRANSFER_REUSE_BUFFER;
+    lua_settop(L, 1);
+    return 1;
+}
+
+/*
+ * Keep the buffer in C memory that lives as long as the transfer.
+ * It only grows and it can't be viewed. A buffer object passed as the
+ * data is always used in place, this only applies to lengths, strings
+ * and lists of pieces.
+ */
+static int lusb_set_native_buffer(lua_State *L)
+{
+    struct lusb_transfer_ud *ud;
+    gettransfer(L, 1);
+    ud = (struct lusb_transfer_ud*)lua_touserdata(L, 1);
+    if (lua_isnone(L, 2) || lua_toboolean(L, 2))
+	ud->flags |= TRANSFER_NATIVE_BUFFER;
+    else
+	ud->flags &= ~TRANSFER_NATIVE_BUFFER;
+    lua_settop(L, 1);
+    return 1;
+}
+
+/* optional flags argument, -1 if it is nil */
+static int checkflags(lua_State *L, int narg)
+{
+    int flags;
+    if (lua_isnoneornil(L, narg))
+	return -1;
+    flags = luaL_checkinteger(L, narg);
+    luaL_argcheck(L, (flags & ~TRANSFER_LUA_FLAGS) == 0, narg, "invalid transfer flags");
+    return flags;
+}
+
+static void applyflags(struct libusb_transfer *tx, int flags)
+{
+    if (flags >= 0)
+	tx->flags = (tx->flags & ~TRANSFER_LUA_FLAGS) | flags;
+}
+
+static int lusb_set_flags(lua_State *L)
+{
+    struct libusb_transfer *tx = gettransfer(L, 1);
+    luaL_checkinteger(L, 2);
+    applyflags(tx, checkflags(L, 2));
+    lua_settop(L, 1);
+    return 1;
+}
+
+static int lusb_get_flags(lua_State *L)
+{
+    struct libusb_transfer *tx = gettransfer(L, 1);
+    lua_pushinteger(L, tx->flags & TRANSFER_LUA_FLAGS);
+    return 1;
 }
 
 static int lusb_cancel_transfer(lua_State *L)
@@ -1269,6 +3788,67 @@ static int lusb_cancel_transfer(lua_State *L)
     return _err(L, err);
 }
 
+static int lusb_transfer_get_status(lua_State *L)
+{
+    struct libusb_transfer *tx = gettransfer(L, 1);
+    lua_pushinteger(L, tx->status);
+    return 1;
+}
+
+static int lusb_transfer_get_actual_length(lua_State *L)
+{
+    struct libusb_transfer *tx = gettransfer(L, 1);
+    lua_pushinteger(L, tx->actual_length);
+    return 1;
+}
+
+static int lusb_transfer_get_length(lua_State *L)
+{
+    struct libusb_transfer *tx = gettransfer(L, 1);
+    lua_pushinteger(L, tx->length);
+    return 1;
+}
+
+static int lusb_transfer_get_endpoint(lua_State *L)
+{
+    struct libusb_transfer *tx = gettransfer(L, 1);
+    lua_pushinteger(L, tx->endpoint);
+    return 1;
+}
+
+static int lusb_transfer_get_type(lua_State *L)
+{
+    struct libusb_transfer *tx = gettransfer(L, 1);
+    lua_pushinteger(L, tx->type);
+    return 1;
+}
+
+static int lusb_transfer_is_active(lua_State *L)
+{
+    struct lusb_transfer_ud *ud;
+    gettransfer(L, 1);
+    ud = (struct lusb_transfer_ud*)lua_touserdata(L, 1);
+    lua_pushboolean(L, l_atomic_load(&ud->active));
+    return 1;
+}
+
+/* monotonic submit and completion times in seconds, nil if not yet */
+static int lusb_transfer_get_times(lua_State *L)
+{
+    struct lusb_transfer_ud *ud;
+    gettransfer(L, 1);
+    ud = (struct lusb_transfer_ud*)lua_touserdata(L, 1);
+    if (ud->submitted > 0)
+	lua_pushnumber(L, ud->submitted);
+    else
+	lua_pushnil(L);
+    if (!l_atomic_load(&ud->active) && ud->completed > 0)
+	lua_pushnumber(L, ud->completed);
+    else
+	lua_pushnil(L);
+    return 2;
+}
+
 static int lusb_transfer_get_data(lua_State *L)
 {
     struct libusb_transfer *tx;
@@ -1327,8 +3907,53 @@ static int lusb_control_transfer_get_setup(lua_State *L)
     return 1;
 }
 
+/* view of the transfer buffer, anchored to the buffer object */
+static void transferview(lua_State *L, int transferidx,
+			 unsigned char *data, size_t len)
+{
+    struct lusb_buffer *owner;
+    lua_getfield(L, LUA_REGISTRYINDEX, BUFFER_REG);
+    lua_pushvalue(L, transferidx);
+    lua_rawget(L, -2);
+    owner = tobuffer(L, -1);
+    if (owner == NULL || data < owner->data || data + len > owner->data + owner->length)
+	luaL_error(L, "transfer buffer is owned by C and can't be viewed");
+    newview(L, -1, data, len);
+    lua_replace(L, -3);
+    lua_pop(L, 1);
+}
+
+static int lusb_transfer_get_view(lua_State *L)
+{
+    struct libusb_transfer *tx;
+    tx = gettransfer(L, 1);
+    if (tx->buffer == NULL)
+    {
+	lua_pushnil(L);
+	return 1;
+    }
+    transferview(L, 1, tx->buffer, tx->actual_length);
+    return 1;
+}
+
+static int lusb_control_transfer_get_view(lua_State *L)
+{
+    struct libusb_transfer *tx;
+    tx = gettransfer(L, 1);
+    if (tx->buffer == NULL)
+    {
+	lua_pushnil(L);
+	return 1;
+    }
+    transferview(L, 1, libusb_control_transfer_get_data(tx), tx->actual_length);
+    return 1;
+}
+
 static void txhandle(lua_State *L, int transferidx, int handleidx)
 {
+    /* the handle is kept alive below for as long as the transfer */
+    ((struct lusb_transfer_ud*)lua_touserdata(L, transferidx))->handle =
+	(struct lusb_handle_ud*)lua_touserdata(L, handleidx);
     lua_getfield(L, LUA_REGISTRYINDEX, HANDLES_REG);
     lua_pushvalue(L, transferidx);
     lua_pushvalue(L, handleidx);
@@ -1339,19 +3964,95 @@ static void txhandle(lua_State *L, int transferidx, int handleidx)
 static unsigned char* transferbuffer(lua_State *L, int transferidx, int len)
 {
     unsigned char *buf;
+    struct lusb_transfer_ud *ud;
     struct libusb_transfer *tx;
-    tx = *(struct libusb_transfer**)lua_touserdata(L, transferidx);
-    buf = (unsigned char*)lua_newuserdata(L, len);
+    ud = (struct lusb_transfer_ud*)lua_touserdata(L, transferidx);
+    tx = ud->tx;
     lua_getfield(L, LUA_REGISTRYINDEX, BUFFER_REG);
+    if (ud->flags & TRANSFER_NATIVE_BUFFER)
+    {
+	if (ud->csize < (size_t)len || ud->cbuf == NULL)
+	{
+	    size_t size = len>0?len:1;
+	    buf = (unsigned char*)realloc(ud->cbuf, size);
+	    if (buf == NULL)
+		luaL_error(L, "not enough memory");
+	    ud->cbuf = buf;
+	    ud->csize = size;
+	}
+	/* drop any Lua buffer used before */
+	lua_pushvalue(L, transferidx);
+	lua_pushnil(L);
+	lua_rawset(L, -3);
+	tx->buffer = ud->cbuf;
+	tx->length = len;
+	tx->actual_length = 0;
+	return ud->cbuf;
+    }
+    if (ud->flags & TRANSFER_REUSE_BUFFER)
+    {
+	/* grow-only, keep the old buffer if it is large enough */
+	struct lusb_buffer *old;
+	lua_pushvalue(L, transferidx);
+	lua_rawget(L, -2);
+	old = tobuffer(L, -1);
+	if (old != NULL && old->length >= (size_t)len)
+	{
+	    buf = old->data;
+	    tx->buffer = buf;
+	    tx->length = len;
+	    tx->actual_length = 0;
+	    return buf;
+	}
+	lua_pop(L, 1);
+    }
+    buf = newbuffer(L, len)->data;
     lua_pushvalue(L, transferidx);
-    lua_pushvalue(L, -3);
-    lua_rawset(L, -3);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, -4);
     tx->buffer = buf;
     tx->length = len;
     tx->actual_length = 0;
     return buf;
 }
 
+/* use a buffer object as the transfer buffer without copying */
+static unsigned char* usebuffer(lua_State *L, int transferidx, int bufidx)
+{
+    struct libusb_transfer *tx;
+    struct lusb_buffer *buf;
+    tx = *(struct libusb_transfer**)lua_touserdata(L, transferidx);
+    buf = (struct lusb_buffer*)lua_touserdata(L, bufidx);
+    lua_getfield(L, LUA_REGISTRYINDEX, BUFFER_REG);
+    lua_pushvalue(L, transferidx);
+    lua_pushvalue(L, bufidx);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+    tx->buffer = buf->data;
+    tx->length = buf->length;
+    tx->actual_length = 0;
+    return buf->data;
+}
+
+/* allocated size of the transfer buffer, may exceed tx->length */
+static size_t buffersize(lua_State *L, int transferidx)
+{
+    struct lusb_transfer_ud *ud;
+    struct lusb_buffer *buf;
+    size_t size;
+    ud = (struct lusb_transfer_ud*)lua_touserdata(L, transferidx);
+    if (ud->cbuf != NULL && ud->tx->buffer == ud->cbuf)
+	return ud->csize;
+    size = ud->tx->length;
+    lua_getfield(L, LUA_REGISTRYINDEX, BUFFER_REG);
+    lua_pushvalue(L, transferidx);
+    lua_rawget(L, -2);
+    if ((buf = tobuffer(L, -1)) != NULL && buf->data == ud->tx->buffer)
+	size = buf->length;
+    lua_pop(L, 2);
+    return size;
+}
+
 static unsigned char* controlsetuptable(lua_State *L, int obj,
 		      int *reqt, int *req, int *val, int *idx,
 		      size_t *len, unsigned char *data)
@@ -1479,64 +4180,138 @@ static int lusb_fill_control_transfer(lua_State *L)
     libusb_device_handle *handle;
     tx = gettransfer(L, 1);
     handle = gethandle(L, 2);
-    if (lua_gettop(L) > 2)
-	fillcontrolsetup(L, 1, 3);
+    if (lua_gettop(L) > 2)
+	fillcontrolsetup(L, 1, 3);
+    txhandle(L, 1, 2);
+    libusb_fill_control_transfer(tx, handle, tx->buffer, NULL, NULL, 0);
+    lua_settop(L, 1);
+    return 1;
+}
+
+/* transfer buffer from a length, buffer object, list of pieces or string */
+static unsigned char* databuffer(lua_State *L, int transferidx, int narg, size_t *len)
+{
+    unsigned char *buf, *data;
+    if (lua_isnumber(L, narg))
+    {
+	*len = lua_tounsigned(L, narg);
+	buf = transferbuffer(L, transferidx, *len);
+    }
+    else if (tobuffer(L, narg) != NULL)
+    {
+	buf = usebuffer(L, transferidx, narg);
+	*len = (*(struct libusb_transfer**)lua_touserdata(L, transferidx))->length;
+    }
+    else if (lua_istable(L, narg))
+    {
+	*len = gatherlen(L, narg);
+	buf = transferbuffer(L, transferidx, *len>0?*len:1);
+	gather(L, narg, buf);
+    }
+    else
+    {
+	data = (unsigned char*)luaL_checklstring(L, narg, len);
+	buf = transferbuffer(L, transferidx, *len>0?*len:1);
+	memcpy(buf, data, *len);
+    }
+    return buf;
+}
+
+static int lusb_fill_bulk_transfer(lua_State *L)
+{
+    struct libusb_transfer *tx;
+    libusb_device_handle *handle;
+    int endp, flags;
+    unsigned char *buf;
+    size_t len;
+    lua_settop(L, 5);
+    tx = gettransfer(L, 1);
+    handle = gethandle(L, 2);
+    endp = luaL_checkinteger(L, 3);
+    flags = checkflags(L, 5);
+    buf = databuffer(L, 1, 4, &len);
+    applyflags(tx, flags);
     txhandle(L, 1, 2);
-    libusb_fill_control_transfer(tx, handle, tx->buffer, NULL, NULL, 0);
+    libusb_fill_bulk_transfer(tx, handle, endp, buf, len, NULL, NULL, 0);
     lua_settop(L, 1);
     return 1;
 }
 
-static int lusb_fill_bulk_transfer(lua_State *L)
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000103)
+static int lusb_fill_bulk_stream_transfer(lua_State *L)
 {
     struct libusb_transfer *tx;
     libusb_device_handle *handle;
-    int endp;
-    unsigned char *buf, *data;
+    int endp, flags;
+    uint32_t stream;
+    unsigned char *buf;
     size_t len;
-    lua_settop(L, 4);
+    lua_settop(L, 6);
     tx = gettransfer(L, 1);
     handle = gethandle(L, 2);
     endp = luaL_checkinteger(L, 3);
-    if (lua_isnumber(L, 4))
-    {
-	len = lua_tounsigned(L, 4);
-	buf = transferbuffer(L, 1, len);
-    }
-    else
-    {
-	data = (unsigned char*)luaL_checklstring(L, 4, &len);
-	buf = transferbuffer(L, 1, len>0?len:1);
-	memcpy(buf, data, len);
-    }
+    stream = luaL_checkunsigned(L, 4);
+    flags = checkflags(L, 6);
+    lua_remove(L, 4);
+    buf = databuffer(L, 1, 4, &len);
+    applyflags(tx, flags);
     txhandle(L, 1, 2);
-    libusb_fill_bulk_transfer(tx, handle, endp, buf, len, NULL, NULL, 0);
+    libusb_fill_bulk_stream_transfer(tx, handle, endp, stream, buf, len, NULL, NULL, 0);
+    lua_settop(L, 1);
+    return 1;
+}
+
+static int lusb_transfer_get_stream_id(lua_State *L)
+{
+    struct libusb_transfer *tx = gettransfer(L, 1);
+    lua_pushinteger(L, libusb_transfer_get_stream_id(tx));
+    return 1;
+}
+
+static int lusb_transfer_set_stream_id(lua_State *L)
+{
+    struct libusb_transfer *tx = gettransfer(L, 1);
+    libusb_transfer_set_stream_id(tx, luaL_checkunsigned(L, 2));
     lua_settop(L, 1);
     return 1;
 }
+#endif
+
+static int lusb_read_async(lua_State *L)
+{
+    struct lusb_transfer_ud *ud;
+    libusb_device_handle *handle;
+    int endp, len;
+    unsigned char *buf;
+    lua_settop(L, 4);
+    handle = gethandle(L, 1);
+    endp = luaL_checkinteger(L, 2);
+    len = luaL_checkinteger(L, 3);
+    luaL_argcheck(L, len >= 0, 3, "invalid length");
+    if ((ud = newtransfer(L, 0))->tx == NULL)
+	return _err(L, LIBUSB_ERROR_NO_MEM);
+    buf = transferbuffer(L, 5, len>0?len:1);
+    txhandle(L, 5, 1);
+    libusb_fill_bulk_transfer(ud->tx, handle, endp | LIBUSB_ENDPOINT_IN,
+			      buf, len, NULL, NULL, luaL_optunsigned(L, 4, 0));
+    lua_settop(L, 5);
+    return awaittransfer(L, 5, AWAIT_DATA);
+}
 
 static int lusb_fill_interrupt_transfer(lua_State *L)
 {
     struct libusb_transfer *tx;
     libusb_device_handle *handle;
-    int endp;
-    unsigned char *buf, *data;
+    int endp, flags;
+    unsigned char *buf;
     size_t len;
-    lua_settop(L, 4);
+    lua_settop(L, 5);
     tx = gettransfer(L, 1);
     handle = gethandle(L, 2);
     endp = luaL_checkinteger(L, 3);
-    if (lua_isnumber(L, 4))
-    {
-	len = lua_tounsigned(L, 4);
-	buf = transferbuffer(L, 1, len);
-    }
-    else
-    {
-	data = (unsigned char*)luaL_checklstring(L, 4, &len);
-	buf = transferbuffer(L, 1, len>0?len:1);
-	memcpy(buf, data, len);
-    }
+    flags = checkflags(L, 5);
+    buf = databuffer(L, 1, 4, &len);
+    applyflags(tx, flags);
     txhandle(L, 1, 2);
     libusb_fill_interrupt_transfer(tx, handle, endp, buf, len, NULL, NULL, 0);
     lua_settop(L, 1);
@@ -1560,6 +4335,11 @@ static int lusb_fill_iso_transfer(lua_State *L)
 	len = lua_tounsigned(L, 4);
 	buf = transferbuffer(L, 1, len);
     }
+    else if (tobuffer(L, 4) != NULL)
+    {
+	buf = usebuffer(L, 1, 4);
+	len = tx->length;
+    }
     else
     {
 	data = (unsigned char*)luaL_checklstring(L, 4, &len);
@@ -1631,6 +4411,122 @@ static int lusb_get_iso_packet_buffer(lua_State *L)
     return 2;
 }
 
+static int lusb_get_iso_packets(lua_State *L)
+{
+    struct libusb_transfer *tx;
+    unsigned int i;
+    size_t offset;
+    ssize_t len;
+    tx = gettransfer(L, 1);
+    if (tx->buffer == NULL)
+    {
+	lua_pushnil(L);
+	return 1;
+    }
+    lua_createtable(L, tx->num_iso_packets, 0);
+    lua_createtable(L, tx->num_iso_packets, 0);
+    lua_createtable(L, tx->num_iso_packets, 0);
+    offset = 0;
+    for (i = 0; i < (unsigned int)tx->num_iso_packets; ++i)
+    {
+	len = tx->length - (ssize_t)offset;
+	if (tx->iso_packet_desc[i].actual_length < len)
+	    len = tx->iso_packet_desc[i].actual_length;
+	else
+	    if (len < 0)
+		len = 0;
+	lua_pushlstring(L, (char*)tx->buffer + offset, len);
+	lua_rawseti(L, -4, i+1);
+	lua_pushinteger(L, tx->iso_packet_desc[i].status);
+	lua_rawseti(L, -3, i+1);
+	lua_pushinteger(L, tx->iso_packet_desc[i].actual_length);
+	lua_rawseti(L, -2, i+1);
+	offset += tx->iso_packet_desc[i].length;
+    }
+    return 3;
+}
+
+/*
+ * Packet lengths and the transfer length are taken from the data, the
+ * packets past the end of the list are left empty.
+ */
+static int lusb_set_iso_packets(lua_State *L)
+{
+    struct libusb_transfer *tx;
+    struct lusb_buffer *src;
+    unsigned int num, i;
+    const unsigned char *data;
+    size_t len, offset, size;
+    lua_settop(L, 2);
+    tx = gettransfer(L, 1);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    if (tx->buffer == NULL)
+	return luaL_error(L, "transfer buffer has not been created");
+    size = buffersize(L, 1);
+    num = luaL_len(L, 2);
+    if (num > (unsigned int)tx->num_iso_packets)
+	num = tx->num_iso_packets;
+    offset = 0;
+    for (i = 0; i < num; ++i)
+    {
+	lua_rawgeti(L, 2, i+1);
+	if ((src = tobuffer(L, 3)) != NULL)
+	{
+	    data = src->data;
+	    len = src->length;
+	}
+	else if (lua_isstring(L, 3))
+	    data = (const unsigned char*)lua_tolstring(L, 3, &len);
+	else
+	    return luaL_error(L, "packet %d: string or buffer expected", i+1);
+	if (len > size - offset)
+	    len = size - offset;
+	memcpy(tx->buffer + offset, data, len);
+	tx->iso_packet_desc[i].length = len;
+	tx->iso_packet_desc[i].actual_length = len;
+	offset += len;
+	lua_pop(L, 1);
+    }
+    for (; i < (unsigned int)tx->num_iso_packets; ++i)
+    {
+	tx->iso_packet_desc[i].length = 0;
+	tx->iso_packet_desc[i].actual_length = 0;
+    }
+    tx->length = offset;
+    lua_settop(L, 1);
+    return 1;
+}
+
+static int lusb_get_iso_packet_view(lua_State *L)
+{
+    struct libusb_transfer *tx;
+    unsigned int i;
+    unsigned char *data;
+    ssize_t len;
+    tx = gettransfer(L, 1);
+    i = luaL_checkunsigned(L, 2);
+    if (tx->buffer == NULL)
+    {
+	lua_pushnil(L);
+	return 1;
+    }
+    data = libusb_get_iso_packet_buffer(tx, i);
+    if (data == NULL)
+    {
+	lua_pushnil(L);
+	return 1;
+    }
+    len = tx->length - (data - tx->buffer);
+    if (tx->iso_packet_desc[i].actual_length < len)
+	len = tx->iso_packet_desc[i].actual_length;
+    else
+	if (len < 0)
+	    len = 0;
+    transferview(L, 1, data, len);
+    lua_pushinteger(L, tx->iso_packet_desc[i].status);
+    return 2;
+}
+
 static int lusb_set_iso_packet_buffer(lua_State *L)
 {
     struct libusb_transfer *tx;
@@ -1663,6 +4559,400 @@ static int lusb_set_iso_packet_buffer(lua_State *L)
     return 1;
 }
 
+static int streamsubmit(struct lusb_stream_slot *slot)
+{
+    int err;
+    if ((err = libusb_submit_transfer(slot->tx)) != 0)
+    {
+	if (slot->stream->error == 0)
+	    slot->stream->error = err;
+	return err;
+    }
+    slot->busy = 1;
+    ++slot->stream->active;
+    return 0;
+}
+
+static void lusb_stream_cb_fn(struct libusb_transfer *tx)
+{
+    struct lusb_stream_slot *slot = (struct lusb_stream_slot*)tx->user_data;
+    struct lusb_stream *s = slot->stream;
+    pthread_mutex_lock(&s->lock);
+    slot->busy = 0;
+    --s->active;
+    s->completed = 1;
+    /* an orphaned ring may have outlived its handle */
+    if (s->handle != NULL && !s->orphaned)
+    {
+	int len = tx->actual_length, i;
+	if (s->packets > 0)
+	    for (len = 0, i = 0; i < tx->num_iso_packets; ++i)
+		len += tx->iso_packet_desc[i].actual_length;
+	counttransfer(s->handle, tx->endpoint, tx->status, len);
+    }
+    if (s->closing)
+    {
+	int done = s->orphaned && s->active == 0;
+	pthread_mutex_unlock(&s->lock);
+	if (done)
+	    freestream(s);
+	return;
+    }
+    switch (tx->status)
+    {
+    case LIBUSB_TRANSFER_COMPLETED:
+    case LIBUSB_TRANSFER_TIMED_OUT:
+	/* iso status is per packet, always deliver */
+	if (tx->actual_length > 0 || s->packets > 0)
+	{
+	    s->ready[(s->head + s->count) % s->depth] = slot - s->slots;
+	    ++s->count;
+	    /* wake a loop polling the event fd, read() is ready */
+	    if (s->handle->ctx != NULL)
+		notify(s->handle->ctx);
+	}
+	else if (s->error == 0)
+	{
+	    /* nothing to deliver, put it straight back */
+	    streamsubmit(slot);
+	}
+	break;
+    case LIBUSB_TRANSFER_CANCELLED:
+	break;
+    default:
+	if (s->error == 0)
+	    s->error = statuserr(tx->status);
+	if (s->handle->ctx != NULL)
+	    notify(s->handle->ctx);
+	break;
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+/* run events until a chunk is ready, timeout in milliseconds */
+static int streamwait(struct lusb_stream *s, unsigned int timeout)
+{
+    struct timeval tv;
+    double deadline, left;
+    int err, waiting;
+    deadline = monotime() + timeout / 1000.0;
+    for (;;)
+    {
+	pthread_mutex_lock(&s->lock);
+	waiting = s->count == 0 && s->active > 0;
+	s->completed = 0;
+	pthread_mutex_unlock(&s->lock);
+	if (!waiting)
+	    break;
+	if (timeout == 0)
+	    err = libusb_handle_events_completed(s->ctx, &s->completed);
+	else
+	{
+	    left = deadline - monotime();
+	    if (left <= 0)
+		break;
+	    tv.tv_sec = (long)left;
+	    tv.tv_usec = (long)((left - tv.tv_sec) * 1000000);
+	    err = libusb_handle_events_timeout_completed(s->ctx, &tv, &s->completed);
+	}
+	if (err != 0 && err != LIBUSB_ERROR_INTERRUPTED)
+	    return err;
+    }
+    return 0;
+}
+
+static struct lusb_stream* getstream(lua_State *L, int ix)
+{
+    struct lusb_stream **s;
+    s = (struct lusb_stream**)luaL_checkudata(L, ix, STREAM_MT);
+    if (*s == NULL)
+	luaL_error(L, "attempt to use a closed stream");
+    return *s;
+}
+
+/* leaves the stream object on the stack */
+static int newstream(lua_State *L, int endp, int packets, int size,
+		     int depth, unsigned int timeout)
+{
+    libusb_device_handle *handle;
+    struct lusb_stream **ud, *s;
+    int length, i, err;
+    handle = gethandle(L, 1);
+    length = packets > 0 ? packets * size : size;
+    ud = (struct lusb_stream**)lua_newuserdata(L, sizeof(struct lusb_stream*));
+    *ud = NULL;
+    luaL_getmetatable(L, STREAM_MT);
+    lua_setmetatable(L, -2);
+    txhandle(L, lua_gettop(L), 1);
+    s = (struct lusb_stream*)calloc(1, sizeof(struct lusb_stream) +
+				    depth * (sizeof(struct lusb_stream_slot) + sizeof(int)));
+    if (s == NULL)
+	return LIBUSB_ERROR_NO_MEM;
+    s->slots = (struct lusb_stream_slot*)(s+1);
+    s->ready = (int*)(s->slots + depth);
+    pthread_mutex_init(&s->lock, NULL);
+    s->depth = depth;
+    s->packets = packets;
+    s->packetsize = size;
+    s->ctx = handlectx(L, 1);
+    s->handle = (struct lusb_handle_ud*)lua_touserdata(L, 1);
+    ++s->handle->users;
+    *ud = s;
+    if ((s->memory = (unsigned char*)malloc((size_t)depth * length)) == NULL)
+	return LIBUSB_ERROR_NO_MEM;
+    for (i = 0; i < depth; ++i)
+    {
+	struct libusb_transfer *tx;
+	s->slots[i].stream = s;
+	if ((tx = s->slots[i].tx = libusb_alloc_transfer(packets)) == NULL)
+	    return LIBUSB_ERROR_NO_MEM;
+	if (packets > 0)
+	{
+	    libusb_fill_iso_transfer(tx, handle, endp,
+				     s->memory + (size_t)i * length, length, packets,
+				     lusb_stream_cb_fn, &s->slots[i], timeout);
+	    libusb_set_iso_packet_lengths(tx, size);
+	}
+	else
+	    libusb_fill_bulk_transfer(tx, handle, endp,
+				      s->memory + (size_t)i * length, length,
+				      lusb_stream_cb_fn, &s->slots[i], timeout);
+    }
+    pthread_mutex_lock(&s->lock);
+    for (err = 0, i = 0; i < depth && err == 0; ++i)
+	err = streamsubmit(&s->slots[i]);
+    pthread_mutex_unlock(&s->lock);
+    /* a partly submitted ring would never resubmit, take it down now */
+    if (err != 0)
+	stopstream(ud);
+    return err;
+}
+
+static int lusb_stream(lua_State *L)
+{
+    int endp, size, depth, err;
+    unsigned int timeout;
+    lua_settop(L, 5);
+    gethandle(L, 1);
+    endp = luaL_checkinteger(L, 2);
+    size = luaL_checkinteger(L, 3);
+    depth = luaL_optinteger(L, 4, 8);
+    timeout = luaL_optunsigned(L, 5, 0);
+    luaL_argcheck(L, (endp & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN,
+		  2, "input endpoint expected");
+    luaL_argcheck(L, size > 0, 3, "transfer size must be positive");
+    luaL_argcheck(L, depth > 0, 4, "depth must be positive");
+    if ((err = newstream(L, endp, 0, size, depth, timeout)) != 0)
+	return _err(L, err);
+    return 1;
+}
+
+static int lusb_iso_stream(lua_State *L)
+{
+    int endp, size, packets, depth, err;
+    unsigned int timeout;
+    lua_settop(L, 6);
+    gethandle(L, 1);
+    endp = luaL_checkinteger(L, 2);
+    size = luaL_checkinteger(L, 3);
+    packets = luaL_checkinteger(L, 4);
+    depth = luaL_optinteger(L, 5, 8);
+    timeout = luaL_optunsigned(L, 6, 0);
+    luaL_argcheck(L, (endp & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN,
+		  2, "input endpoint expected");
+    luaL_argcheck(L, size > 0, 3, "packet size must be positive");
+    luaL_argcheck(L, packets > 0, 4, "packet count must be positive");
+    luaL_argcheck(L, depth > 0, 5, "depth must be positive");
+    if ((err = newstream(L, endp, packets, size, depth, timeout)) != 0)
+	return _err(L, err);
+    return 1;
+}
+
+static unsigned int isopacketlen(struct libusb_iso_packet_descriptor *pkt)
+{
+    return pkt->status == LIBUSB_TRANSFER_COMPLETED ? pkt->actual_length : 0;
+}
+
+/*
+ * Valid packets concatenated, then { length1, status1, length2, ... }.
+ * A failed packet has length 0, so the lengths add up to the data.
+ */
+static void pushisochunk(lua_State *L, struct lusb_stream *s,
+			 struct libusb_transfer *tx)
+{
+    luaL_Buffer buffer;
+    int i;
+    luaL_buffinit(L, &buffer);
+    for (i = 0; i < tx->num_iso_packets; ++i)
+    {
+	unsigned int len = isopacketlen(&tx->iso_packet_desc[i]);
+	if (len > 0)
+	    luaL_addlstring(&buffer,
+			    (const char*)tx->buffer + (size_t)i * s->packetsize,
+			    len);
+    }
+    luaL_pushresult(&buffer);
+    lua_createtable(L, 2 * tx->num_iso_packets, 0);
+    for (i = 0; i < tx->num_iso_packets; ++i)
+    {
+	lua_pushinteger(L, isopacketlen(&tx->iso_packet_desc[i]));
+	lua_rawseti(L, -2, 2*i + 1);
+	lua_pushinteger(L, tx->iso_packet_desc[i].status);
+	lua_rawseti(L, -2, 2*i + 2);
+    }
+}
+
+static int lusb_stream_read(lua_State *L)
+{
+    struct lusb_stream *s;
+    struct libusb_transfer *tx;
+    int slot, err;
+    s = getstream(L, 1);
+    if ((err = streamwait(s, luaL_optunsigned(L, 2, 0))) != 0)
+	return _err(L, err);
+    pthread_mutex_lock(&s->lock);
+    if (s->count == 0)
+    {
+	err = s->error ? s->error : LIBUSB_ERROR_TIMEOUT;
+	pthread_mutex_unlock(&s->lock);
+	return _err(L, err);
+    }
+    slot = s->ready[s->head];
+    s->head = (s->head + 1) % s->depth;
+    --s->count;
+    tx = s->slots[slot].tx;
+    if (s->packets > 0)
+	pushisochunk(L, s, tx);
+    else
+	lua_pushlstring(L, (const char*)tx->buffer, tx->actual_length);
+    /* hand the transfer back to the bus */
+    if (s->error == 0)
+	streamsubmit(&s->slots[slot]);
+    pthread_mutex_unlock(&s->lock);
+    return s->packets > 0 ? 2 : 1;
+}
+
+static int lusb_stream_pending(lua_State *L)
+{
+    struct lusb_stream *s = getstream(L, 1);
+    pthread_mutex_lock(&s->lock);
+    lua_pushinteger(L, s->count);
+    lua_pushinteger(L, s->active);
+    pthread_mutex_unlock(&s->lock);
+    return 2;
+}
+
+static int lusb_stream_close(lua_State *L)
+{
+    getstream(L, 1);
+    stopstream((struct lusb_stream**)lua_touserdata(L, 1));
+    return 0;
+}
+
+static int lusb_buffer(lua_State *L)
+{
+    struct lusb_buffer *buf;
+    const char *str;
+    size_t len;
+    /* not lua_isnumber, "1234" is four bytes of data */
+    if (lua_type(L, 1) == LUA_TNUMBER)
+    {
+	len = luaL_checkunsigned(L, 1);
+	buf = newbuffer(L, len);
+	memset(buf->data, 0, len);
+    }
+    else
+    {
+	str = luaL_checklstring(L, 1, &len);
+	buf = newbuffer(L, len);
+	memcpy(buf->data, str, len);
+    }
+    return 1;
+}
+
+static int lusb_buffer_len(lua_State *L)
+{
+    struct lusb_buffer *buf = getbuffer(L, 1);
+    lua_pushinteger(L, buf->length);
+    return 1;
+}
+
+static int lusb_buffer_byte(lua_State *L)
+{
+    struct lusb_buffer *buf;
+    size_t start, len, n;
+    buf = getbuffer(L, 1);
+    len = bufrange(L, buf->length, 2, 1, 3, luaL_optinteger(L, 2, 1), &start);
+    luaL_checkstack(L, (int)len, "buffer slice too long");
+    for (n = 0; n < len; ++n)
+	lua_pushinteger(L, buf->data[start+n]);
+    return (int)len;
+}
+
+static int lusb_buffer_setbyte(lua_State *L)
+{
+    struct lusb_buffer *buf;
+    lua_Integer i;
+    int n, top;
+    buf = getbuffer(L, 1);
+    i = luaL_checkinteger(L, 2);
+    top = lua_gettop(L);
+    if (i < 0)
+	i = (lua_Integer)buf->length + i + 1;
+    if (i < 1 || i + (top - 2) - 1 > (lua_Integer)buf->length)
+	return luaL_argerror(L, 2, "index out of range");
+    for (n = 3; n <= top; ++n)
+	buf->data[i+n-4] = (unsigned char)luaL_checkinteger(L, n);
+    lua_settop(L, 1);
+    return 1;
+}
+
+static int lusb_buffer_write(lua_State *L)
+{
+    struct lusb_buffer *buf, *src;
+    const unsigned char *data;
+    lua_Integer i;
+    size_t len;
+    buf = getbuffer(L, 1);
+    i = luaL_checkinteger(L, 2);
+    if ((src = tobuffer(L, 3)) != NULL)
+    {
+	data = src->data;
+	len = src->length;
+    }
+    else
+	data = (const unsigned char*)luaL_checklstring(L, 3, &len);
+    if (i < 0)
+	i = (lua_Integer)buf->length + i + 1;
+    if (i < 1 || i > (lua_Integer)buf->length + 1)
+	return luaL_argerror(L, 2, "index out of range");
+    if (len > buf->length - (size_t)(i - 1))
+	len = buf->length - (size_t)(i - 1);
+    memmove(buf->data + i - 1, data, len);
+    lua_settop(L, 1);
+    return 1;
+}
+
+static int lusb_buffer_sub(lua_State *L)
+{
+    struct lusb_buffer *buf;
+    size_t start, len;
+    buf = getbuffer(L, 1);
+    len = bufrange(L, buf->length, 2, 1, 3, -1, &start);
+    newview(L, 1, buf->data + start, len);
+    return 1;
+}
+
+static int lusb_buffer_tostring(lua_State *L)
+{
+    struct lusb_buffer *buf;
+    size_t start, len;
+    buf = getbuffer(L, 1);
+    len = bufrange(L, buf->length, 2, 1, 3, -1, &start);
+    lua_pushlstring(L, (const char*)buf->data + start, len);
+    return 1;
+}
+
 static void pushtimeval(lua_State *L, struct timeval *tv)
 {
     lua_Number ftime = (lua_Number)tv->tv_usec / 1000000 + tv->tv_sec;
@@ -1755,6 +5045,7 @@ static int lusb_unlock_event_waiters(lua_State *L)
     return 0;
 }
 
+/* like handle_events_locked, leaves resumes to ctx:dispatch() */
 static int lusb_wait_for_event(lua_State *L)
 {
     libusb_context *ctx;
@@ -1781,45 +5072,52 @@ static int lusb_wait_for_event(lua_State *L)
 
 static int lusb_handle_events(lua_State *L)
 {
-    libusb_context *ctx;
+    struct lusb_context_ud *ud;
     int err;
-    if (!lua_isnoneornil(L, 1))
-    	ctx = getctx(L, 1);
-    else
-	ctx = defctx(L);
-    if ((err = libusb_handle_events(ctx)) != 0)
+    ud = getctxud(L, 1);
+    if ((err = libusb_handle_events(ud->ctx)) != 0)
 	return _err(L, err);
+    /* coroutines that completed are resumed out here */
+    dispatchevents(L, ud, 0);
     lua_pushboolean(L, 1);
     return 1;
 }
 
 static int lusb_handle_events_timeout(lua_State *L)
 {
-    libusb_context *ctx;
+    struct lusb_context_ud *ud;
     struct timeval tv;
     int err;
     lua_settop(L, 2);
     if (!lua_isnil(L, 2))
     {
-    	ctx = getctx(L, 1);
+    	getctx(L, 1);
+	ud = (struct lusb_context_ud*)lua_touserdata(L, 1);
 	poptimeval(L, 2, &tv);
     }
     else if (lua_isnumber(L, 1))
     {
-	ctx = defctx(L);
+	defctx(L);
+	ud = (struct lusb_context_ud*)lua_touserdata(L, -1);
 	poptimeval(L, 1, &tv);
     }
     else
     {
-	ctx = getctx(L, 1);
+	getctx(L, 1);
+	ud = (struct lusb_context_ud*)lua_touserdata(L, 1);
 	tv.tv_sec = tv.tv_usec = 0;
     }
-    if ((err = libusb_handle_events_timeout(ctx, &tv)) != 0)
+    if ((err = libusb_handle_events_timeout(ud->ctx, &tv)) != 0)
 	return _err(L, err);
+    dispatchevents(L, ud, 0);
     lua_pushboolean(L, 1);
     return 1;
 }
 
+/*
+ * The events lock is held, so completed coroutines are not resumed
+ * here. Call ctx:dispatch() after unlocking, as after wait_for_event.
+ */
 static int lusb_handle_events_locked(lua_State *L)
 {
     libusb_context *ctx;
@@ -2092,10 +5390,592 @@ static int lusb_set_pollfd_notifiers(lua_State *L)
     return 0;
 }
 
+static int lusb_start_event_thread(lua_State *L)
+{
+    int err = startthread(getctxud(L, 1));
+    return _err(L, err);
+}
+
+static int lusb_stop_event_thread(lua_State *L)
+{
+    stopthread(getctxud(L, 1));
+    return 0;
+}
+
+static int lusb_poll_completions(lua_State *L)
+{
+    struct lusb_context_ud *ud;
+    int max;
+    if (lua_isuserdata(L, 1))
+    {
+	ud = getctxud(L, 1);
+	max = luaL_optinteger(L, 2, 0);
+    }
+    else
+    {
+	max = luaL_optinteger(L, 1, 0);
+	ud = getctxud(L, 2);
+    }
+    lua_pushinteger(L, dispatchevents(L, ud, max));
+    return 1;
+}
+
+/* a descriptor that is readable when there are completions to dispatch */
+static int lusb_get_event_fd(lua_State *L)
+{
+    struct lusb_context_ud *ud = getctxud(L, 1);
+    int err;
+    if (ud->evfd[0] < 0 && (err = opennotifier(ud)) != 0)
+	return _err(L, err);
+    /* the thread also takes care of timeouts */
+    if ((err = startthread(ud)) != 0)
+	return _err(L, err);
+    lua_pushinteger(L, ud->evfd[0]);
+    return 1;
+}
+
+/* handle events without blocking and run any ready callbacks */
+static int lusb_dispatch(lua_State *L)
+{
+    struct lusb_context_ud *ud = getctxud(L, 1);
+    struct timeval tv;
+    int err;
+    drainnotifier(ud);
+    if (!ud->threaded)
+    {
+	tv.tv_sec = 0;
+	tv.tv_usec = 0;
+	if ((err = libusb_handle_events_timeout_completed(ud->ctx, &tv, NULL)) != 0)
+	    return _err(L, err);
+    }
+    lua_pushinteger(L, dispatchevents(L, ud, 0));
+    return 1;
+}
+
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000102)
+struct lusb_hotplug_cb
+{
+    lua_State *L;
+    struct lusb_context_ud *owner;
+    libusb_hotplug_callback_handle handle;	/* the id Lua sees, 0 until known */
+    struct lusb_hotplug_cb *next;	/* in owner->hotplug */
+    int ref;
+    int refs;	/* the registration plus queued events */
+    int dead;
+    int track;	/* maintains the attached device set */
+};
+
+struct lusb_hotplug_ev
+{
+    struct lusb_event ev;	/* must come first */
+    struct lusb_hotplug_cb *cb;
+    libusb_device *dev;
+    int event;
+};
+
+static void hotplugunref(struct lusb_hotplug_cb *cb)
+{
+    if (l_atomic_add(&cb->refs, -1) == 0)
+	free(cb);
+}
+
+/* forget a registration that libusb no longer calls */
+static void hotplugrelease(lua_State *L, struct lusb_hotplug_cb *cb)
+{
+    struct lusb_hotplug_cb **pp;
+    if (!cb->dead)
+    {
+	cb->dead = 1;
+	for (pp = &cb->owner->hotplug; *pp != NULL; pp = &(*pp)->next)
+	    if (*pp == cb)
+	    {
+		*pp = cb->next;
+		break;
+	    }
+	lua_getfield(L, LUA_REGISTRYINDEX, HOTPLUG_REG);
+	luaL_unref(L, -1, cb->ref);
+	lua_pop(L, 1);
+	hotplugunref(cb);
+    }
+}
+
+/* returns true when the callback asks to be deregistered */
+static int hotplugdone(lua_State *L, struct lusb_hotplug_cb *cb,
+		       libusb_device *dev, int event)
+{
+    int base, done = 0;
+    if (cb->dead || !lua_checkstack(L, 8))
+	return 0;
+    base = lua_gettop(L);
+    lua_getfield(L, LUA_REGISTRYINDEX, HOTPLUG_REG);
+    lua_rawgeti(L, -1, cb->ref);
+    /* { callback, cb }, the context is only weakly held */
+    lua_getfield(L, LUA_REGISTRYINDEX, CONTEXTS_REG);
+    lua_pushlightuserdata(L, cb->owner);
+    lua_rawget(L, -2);
+    lua_remove(L, -2);
+    if (lua_isnil(L, -1))
+    {
+	lua_settop(L, base);
+	return 0;
+    }
+    newdev(L, -1, dev);
+    if (cb->track)
+    {
+	lua_getfield(L, LUA_REGISTRYINDEX, ATTACHED_REG);
+	lua_pushvalue(L, -3);
+	lua_rawget(L, -2);
+	lua_pushvalue(L, -3);
+	if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED)
+	    lua_pushboolean(L, 1);
+	else
+	    lua_pushnil(L);
+	lua_rawset(L, -3);
+	lua_pop(L, 2);
+    }
+    lua_rawgeti(L, -3, 1);
+    if (lua_isfunction(L, -1))
+    {
+	lua_pushvalue(L, -2);
+	lua_pushinteger(L, event);
+	if (lua_pcall(L, 2, 1, 0) == 0)
+	    done = lua_toboolean(L, -1);
+    }
+    lua_settop(L, base);
+    return done;
+}
+
+static void lusb_hotplug_dispatch(lua_State *L, struct lusb_event *e)
+{
+    struct lusb_hotplug_ev *ev = (struct lusb_hotplug_ev*)e;
+    struct lusb_hotplug_cb *cb = ev->cb;
+    if (hotplugdone(L, cb, ev->dev, ev->event))
+    {
+	libusb_hotplug_deregister_callback(cb->owner->ctx, cb->handle);
+	hotplugrelease(L, cb);
+    }
+    libusb_unref_device(ev->dev);
+    hotplugunref(cb);
+    free(ev);
+}
+
+static void lusb_hotplug_discard(lua_State *L, struct lusb_event *e)
+{
+    struct lusb_hotplug_ev *ev = (struct lusb_hotplug_ev*)e;
+    (void)L;
+    libusb_unref_device(ev->dev);
+    hotplugunref(ev->cb);
+    free(ev);
+}
+
+static int LIBUSB_CALL lusb_hotplug_cb_fn(libusb_context *ctx, libusb_device *dev,
+				     libusb_hotplug_event event, void *user_data)
+{
+    struct lusb_hotplug_cb *cb = (struct lusb_hotplug_cb*)user_data;
+    struct lusb_hotplug_ev *ev;
+    (void)ctx;
+    if (cb->owner->threaded && pthread_equal(pthread_self(), cb->owner->thread))
+    {
+	/* never call into Lua from the event thread */
+	ev = (struct lusb_hotplug_ev*)malloc(sizeof(struct lusb_hotplug_ev));
+	if (ev != NULL)
+	{
+	    ev->ev.dispatch = lusb_hotplug_dispatch;
+	    ev->ev.discard = lusb_hotplug_discard;
+	    ev->cb = cb;
+	    ev->dev = libusb_ref_device(dev);
+	    ev->event = event;
+	    l_atomic_add(&cb->refs, 1);
+	    postevent(cb->owner, &ev->ev);
+	}
+	return 0;
+    }
+    /* libusb deregisters it when we return 1 */
+    if (hotplugdone(cb->L, cb, dev, event))
+    {
+	hotplugrelease(cb->L, cb);
+	return 1;
+    }
+    return 0;
+}
+
+static int hotplugregister(lua_State *L, struct lusb_context_ud *owner,
+			   int ctxidx, int fnidx, int events, int flags,
+			   int vid, int pid, int cls, int track, int *id)
+{
+    struct lusb_hotplug_cb *cb;
+    libusb_hotplug_callback_handle handle;
+    int err;
+    if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+    cb = (struct lusb_hotplug_cb*)malloc(sizeof(struct lusb_hotplug_cb));
+    if (cb == NULL)
+	return LIBUSB_ERROR_NO_MEM;
+    ctxidx = lua_absindex(L, ctxidx);
+    fnidx = lua_absindex(L, fnidx);
+    /* a strong reference to the context would keep it from exiting */
+    lua_getfield(L, LUA_REGISTRYINDEX, CONTEXTS_REG);
+    lua_pushlightuserdata(L, owner);
+    lua_pushvalue(L, ctxidx);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+    lua_getfield(L, LUA_REGISTRYINDEX, HOTPLUG_REG);
+    lua_createtable(L, 2, 0);
+    lua_pushvalue(L, fnidx);
+    lua_rawseti(L, -2, 1);
+    lua_pushlightuserdata(L, cb);
+    lua_rawseti(L, -2, 2);
+    cb->ref = luaL_ref(L, -2);
+    lua_pop(L, 1);
+    cb->L = mainthread(L);
+    cb->owner = owner;
+    cb->handle = 0;
+    cb->dead = 0;
+    cb->track = track;
+    /* linked first, enumeration may already release it */
+    cb->next = owner->hotplug;
+    owner->hotplug = cb;
+    /* hold on to it for the same reason */
+    cb->refs = 2;
+    err = libusb_hotplug_register_callback(owner->ctx, events, flags,
+					   vid, pid, cls, lusb_hotplug_cb_fn,
+					   cb, &handle);
+    if (err != 0)
+	hotplugrelease(L, cb);
+    else
+	cb->handle = handle;
+    *id = handle;
+    hotplugunref(cb);
+    return err;
+}
+
+/* deregisters everything before the context goes away */
+static void hotplugexit(lua_State *L, struct lusb_context_ud *ud)
+{
+    struct lusb_hotplug_cb *cb;
+    while ((cb = ud->hotplug) != NULL)
+    {
+	if (cb->handle != 0)
+	    libusb_hotplug_deregister_callback(ud->ctx, cb->handle);
+	hotplugrelease(L, cb);
+    }
+}
+
+static int lusb_hotplug_register(lua_State *L)
+{
+    struct lusb_context_ud *ud;
+    int ctxidx, fnidx, events, flags = 0, err, id;
+    int vid = LIBUSB_HOTPLUG_MATCH_ANY, pid = LIBUSB_HOTPLUG_MATCH_ANY;
+    int cls = LIBUSB_HOTPLUG_MATCH_ANY;
+    if (lua_isuserdata(L, 1))
+    {
+	lua_settop(L, 3);
+	ctxidx = 1;
+	fnidx = 2;
+    }
+    else
+    {
+	lua_settop(L, 2);
+	ctxidx = 3;
+	fnidx = 1;
+    }
+    ud = getctxud(L, ctxidx);
+    luaL_checktype(L, fnidx, LUA_TFUNCTION);
+    events = LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT;
+    if (lua_istable(L, fnidx+1))
+    {
+	events = optintfield(L, fnidx+1, "events", events);
+	vid = optintfield(L, fnidx+1, "vendor_id", vid);
+	pid = optintfield(L, fnidx+1, "product_id", pid);
+	cls = optintfield(L, fnidx+1, "class", cls);
+	lua_getfield(L, fnidx+1, "enumerate");
+	if (lua_toboolean(L, -1))
+	    flags = LIBUSB_HOTPLUG_ENUMERATE;
+	lua_pop(L, 1);
+    }
+    err = hotplugregister(L, ud, ctxidx, fnidx,
+			  events, flags, vid, pid, cls, 0, &id);
+    if (err != 0)
+	return _err(L, err);
+    lua_pushinteger(L, id);
+    return 1;
+}
+
+/* ids are libusb callback handles, only valid with their own context */
+static int lusb_hotplug_deregister(lua_State *L)
+{
+    struct lusb_context_ud *ud;
+    struct lusb_hotplug_cb *cb;
+    int id;
+    if (lua_isuserdata(L, 1))
+    {
+	ud = getctxud(L, 1);
+	id = luaL_checkinteger(L, 2);
+    }
+    else
+    {
+	id = luaL_checkinteger(L, 1);
+	ud = getctxud(L, 2);
+    }
+    for (cb = ud->hotplug; cb != NULL; cb = cb->next)
+	if (!cb->track && cb->handle != 0 && cb->handle == id)
+	    break;
+    if (cb == NULL)
+	return _err(L, LIBUSB_ERROR_NOT_FOUND);
+    libusb_hotplug_deregister_callback(ud->ctx, cb->handle);
+    hotplugrelease(L, cb);
+    return _err(L, 0);
+}
+
+/*
+ * Set of the devices attached to a context, as { [device] = true }.
+ * It is kept up to date by hotplug events, don't modify it.
+ */
+static int lusb_attached_devices(lua_State *L)
+{
+    struct lusb_context_ud *ud;
+    int ctxidx, err, id;
+    lua_settop(L, 1);
+    ud = getctxud(L, 1);
+    ctxidx = lua_gettop(L);
+    lua_getfield(L, LUA_REGISTRYINDEX, ATTACHED_REG);
+    lua_pushvalue(L, ctxidx);
+    lua_rawget(L, -2);
+    if (lua_isnil(L, -1))
+    {
+	lua_pop(L, 1);
+	lua_newtable(L);
+	lua_pushvalue(L, ctxidx);
+	lua_pushvalue(L, -2);
+	lua_rawset(L, -4);
+	lua_pushnil(L);
+	err = hotplugregister(L, ud, ctxidx, -1,
+			      LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
+			      LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+			      LIBUSB_HOTPLUG_ENUMERATE,
+			      LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+			      LIBUSB_HOTPLUG_MATCH_ANY, 1, &id);
+	lua_pop(L, 1);
+	if (err != 0)
+	{
+	    lua_pushvalue(L, ctxidx);
+	    lua_pushnil(L);
+	    lua_rawset(L, -4);
+	    return _err(L, err);
+	}
+    }
+    return 1;
+}
+#endif
+
+#define PREFETCH_TIMEOUT	1000	/* milliseconds when none is given */
+
+/* what every device in prefetch_strings shares, followed by the devices */
+struct lusb_prefetch_set
+{
+    int pending;
+    int done;
+};
+
+/* state of one device in prefetch_strings */
+struct lusb_prefetch
+{
+    libusb_device_handle *handle;
+    struct libusb_transfer *tx;
+    struct lusb_prefetch_set *set;
+    double deadline;
+    int step;	/* 0 for the LANGID table, then each string */
+    uint8_t idx[3];
+    uint16_t langid;	/* 0 until the LANGID table was read */
+    int len[3];
+    uint16_t str[3][127];
+    unsigned char buf[LIBUSB_CONTROL_SETUP_SIZE + 255];
+};
+
+static void LIBUSB_CALL lusb_prefetch_cb_fn(struct libusb_transfer *tx);
+
+/* request the next string, returns false when there's nothing left */
+static int prefetchsubmit(struct lusb_prefetch *p)
+{
+    unsigned int timeout;
+    int idx = 0, langid = 0;
+    double left;
+    if (p->step > 0)
+    {
+	while (p->step <= 3 && p->idx[p->step-1] == 0)
+	    ++p->step;
+	if (p->step > 3)
+	    return 0;
+	idx = p->idx[p->step-1];
+	langid = p->langid;
+    }
+    /* each request only gets what is left of the timeout */
+    left = p->deadline - monotime();
+    if (left <= 0)
+	return 0;
+    timeout = (unsigned int)(left * 1000) + 1;
+    libusb_fill_control_setup(p->buf, LIBUSB_ENDPOINT_IN,
+			      LIBUSB_REQUEST_GET_DESCRIPTOR,
+			      (LIBUSB_DT_STRING << 8) | idx, langid, 255);
+    libusb_fill_control_transfer(p->tx, p->handle, p->buf,
+				 lusb_prefetch_cb_fn, p, timeout);
+    return libusb_submit_transfer(p->tx) == 0;
+}
+
+static void LIBUSB_CALL lusb_prefetch_cb_fn(struct libusb_transfer *tx)
+{
+    struct lusb_prefetch *p = (struct lusb_prefetch*)tx->user_data;
+    unsigned char *data = libusb_control_transfer_get_data(tx);
+    int len = tx->actual_length;
+    if (tx->status == LIBUSB_TRANSFER_COMPLETED && len >= 2)
+    {
+	if (data[0] < len)
+	    len = data[0];
+	if (p->step == 0)
+	{
+	    if (len < 4)
+		p->step = 3;
+	    else
+		p->langid = data[2] | (data[3] << 8);
+	}
+	else
+	{
+	    p->len[p->step-1] = (len - 2) / 2;
+	    memcpy(p->str[p->step-1], data + 2, len - 2);
+	}
+    }
+    else if (p->step == 0)
+	p->step = 3;
+    ++p->step;
+    /* a cancelled or vanished device gets no more requests */
+    if (tx->status == LIBUSB_TRANSFER_CANCELLED || tx->status == LIBUSB_TRANSFER_NO_DEVICE
+     || !prefetchsubmit(p))
+    {
+	if (l_atomic_add(&p->set->pending, -1) == 0)
+	    l_atomic_store(&p->set->done, 1);
+    }
+}
+
+/*
+ * Read the manufacturer, product and serial number strings of every device
+ * at once. Returns { [device] = { manufacturer=, product=, serial= } } and
+ * fills the string cache that get_strings and the device filters use.
+ */
+static int lusb_prefetch_strings(lua_State *L)
+{
+    static const char *const names[] = {"manufacturer", "product", "serial"};
+    struct libusb_device_descriptor desc;
+    struct lusb_prefetch_set *set;
+    struct lusb_prefetch *p;
+    libusb_context *ctx;
+    libusb_device *dev;
+    int n, i, k, err, timeout, cancelled = 0;
+    double deadline;
+    if (lua_isuserdata(L, 1))
+	ctx = getctx(L, 1);
+    else
+    {
+	ctx = defctx(L);
+	lua_insert(L, 1);
+    }
+    luaL_checktype(L, 2, LUA_TTABLE);
+    /* without a limit an unresponsive device stalls everything */
+    if ((timeout = luaL_optinteger(L, 3, 0)) <= 0)
+	timeout = PREFETCH_TIMEOUT;
+    deadline = monotime() + timeout / 1000.0;
+    lua_settop(L, 2);
+    n = lua_rawlen(L, 2);
+    for (i = 1; i <= n; ++i)
+    {
+	lua_rawgeti(L, 2, i);
+	getdev(L, -1);
+	lua_pop(L, 1);
+    }
+    set = (struct lusb_prefetch_set*)calloc(1, sizeof(struct lusb_prefetch_set) +
+					    (n > 0 ? n : 1) * sizeof(struct lusb_prefetch));
+    if (set == NULL)
+	return _err(L, LIBUSB_ERROR_NO_MEM);
+    p = (struct lusb_prefetch*)(set+1);
+    for (i = 0; i < n; ++i)
+    {
+	lua_rawgeti(L, 2, i+1);
+	dev = getdev(L, -1);
+	lua_pop(L, 1);
+	p[i].set = set;
+	p[i].deadline = deadline;
+	p[i].len[0] = p[i].len[1] = p[i].len[2] = -1;
+	if (libusb_get_device_descriptor(dev, &desc) != 0
+	 || (desc.iManufacturer|desc.iProduct|desc.iSerialNumber) == 0)
+	    continue;
+	p[i].idx[0] = desc.iManufacturer;
+	p[i].idx[1] = desc.iProduct;
+	p[i].idx[2] = desc.iSerialNumber;
+	if (libusb_open(dev, &p[i].handle) != 0)
+	{
+	    p[i].handle = NULL;
+	    continue;
+	}
+	if ((p[i].tx = libusb_alloc_transfer(0)) == NULL)
+	    continue;
+	l_atomic_add(&set->pending, 1);
+	if (!prefetchsubmit(&p[i]))
+	    l_atomic_add(&set->pending, -1);
+    }
+    if (l_atomic_load(&set->pending) == 0)
+	set->done = 1;
+    /* the transfer timeouts bound this loop */
+    while (!l_atomic_load(&set->done))
+    {
+	err = libusb_handle_events_completed(ctx, &set->done);
+	if (err == 0 || err == LIBUSB_ERROR_INTERRUPTED)
+	    continue;
+	/* transfers may still be in flight, so the state is leaked */
+	if (cancelled)
+	    return _err(L, err);
+	for (i = 0; i < n; ++i)
+	    if (p[i].tx != NULL)
+		libusb_cancel_transfer(p[i].tx);
+	cancelled = 1;
+    }
+    lua_createtable(L, 0, n);
+    for (i = 0; i < n; ++i)
+    {
+	if (p[i].handle == NULL)
+	    continue;
+	if (p[i].tx != NULL)
+	{
+	    lua_rawgeti(L, 2, i+1);
+	    stringcache(L, -1);
+	    if (p[i].langid != 0)
+	    {
+		lua_pushinteger(L, p[i].langid);
+		lua_rawseti(L, -2, 0);
+	    }
+	    lua_createtable(L, 0, 3);
+	    for (k = 0; k < 3; ++k)
+		if (p[i].len[k] >= 0)
+		{
+		    pushutf16(L, p[i].str[k], p[i].len[k]);
+		    lua_pushvalue(L, -1);
+		    lua_rawseti(L, -4, p[i].idx[k]);
+		    lua_setfield(L, -2, names[k]);
+		}
+	    lua_remove(L, -2);
+	    lua_rawset(L, -3);
+	    libusb_free_transfer(p[i].tx);
+	}
+	libusb_close(p[i].handle);
+    }
+    free(set);
+    return 1;
+}
 
 static const luaL_Reg lusb_ctx_methods[] = {
     {"set_debug", lusb_set_debug},
     {"get_device_list", lusb_get_device_list},
+    {"get_device_changes", lusb_get_device_changes},
+    {"find_devices", lusb_find_devices},
+    {"open_devices", lusb_open_devices},
     {"try_lock_events", lusb_try_lock_events},
     {"lock_events", lusb_lock_events},
     {"unlock_events", lusb_unlock_events},
@@ -2111,6 +5991,18 @@ static const luaL_Reg lusb_ctx_methods[] = {
     {"get_next_timeout", lusb_get_next_timeout},
     {"get_pollfds", lusb_get_pollfds},
     {"set_pollfd_notifiers", lusb_set_pollfd_notifiers},
+    {"start_event_thread", lusb_start_event_thread},
+    {"stop_event_thread", lusb_stop_event_thread},
+    {"poll_completions", lusb_poll_completions},
+    {"get_event_fd", lusb_get_event_fd},
+    {"dispatch", lusb_dispatch},
+    {"prefetch_strings", lusb_prefetch_strings},
+    {"stats", lusb_ctx_stats},
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000102)
+    {"hotplug_register", lusb_hotplug_register},
+    {"hotplug_deregister", lusb_hotplug_deregister},
+    {"attached_devices", lusb_attached_devices},
+#endif
     {NULL, NULL}
 };
 
@@ -2123,6 +6015,10 @@ static const luaL_Reg lusb_dev_methods[] = {
     {"get_active_config_descriptor", lusb_get_active_config_descriptor},
     {"get_config_descriptor", lusb_get_config_descriptor},
     {"get_config_descriptor_by_value", lusb_get_config_descriptor_by_value},
+    {"get_device_descriptor_proxy", lusb_get_device_descriptor_proxy},
+    {"get_active_config_descriptor_proxy", lusb_get_active_config_descriptor_proxy},
+    {"get_config_descriptor_proxy", lusb_get_config_descriptor_proxy},
+    {"get_config_descriptor_by_value_proxy", lusb_get_config_descriptor_by_value_proxy},
     {"open", lusb_open},
     {NULL, NULL}
 };
@@ -2143,34 +6039,112 @@ static const luaL_Reg lusb_handle_methods[] = {
     {"control_transfer", lusb_control_transfer},
     {"bulk_transfer", lusb_bulk_transfer},
     {"interrupt_transfer", lusb_interrupt_transfer},
+    {"bulk_transfer_buffer", lusb_bulk_transfer_buffer},
+    {"interrupt_transfer_buffer", lusb_interrupt_transfer_buffer},
     {"get_descriptor", lusb_get_descriptor},
     {"get_string_descriptor", lusb_get_string_descriptor},
     {"get_string_descriptor_ascii", lusb_get_string_descriptor_ascii},
     {"get_string_descriptor_utf8", lusb_get_string_descriptor_utf8},
+    {"get_strings", lusb_get_strings},
+    {"stats", lusb_handle_stats},
+    {"latency_stats", lusb_latency_stats},
+    {"reset_latency_stats", lusb_reset_latency_stats},
+    {"dev_mem_alloc", lusb_dev_mem_alloc},
+    {"stream", lusb_stream},
+    {"iso_stream", lusb_iso_stream},
+    {"read_async", lusb_read_async},
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000103)
+    {"alloc_streams", lusb_alloc_streams},
+    {"free_streams", lusb_free_streams},
+#endif
     {NULL, NULL}
 };
 
 static const luaL_Reg lusb_transfer_methods[] = {
     {"submit_transfer", lusb_submit_transfer},
+    {"resubmit_transfer", lusb_resubmit_transfer},
     {"cancel_transfer", lusb_cancel_transfer},
+    {"await", lusb_transfer_await},
+    {"set_reuse_buffer", lusb_set_reuse_buffer},
+    {"set_native_buffer", lusb_set_native_buffer},
+    {"set_flags", lusb_set_flags},
+    {"get_flags", lusb_get_flags},
+    {"transfer_get_status", lusb_transfer_get_status},
+    {"transfer_get_actual_length", lusb_transfer_get_actual_length},
+    {"transfer_get_length", lusb_transfer_get_length},
+    {"transfer_get_endpoint", lusb_transfer_get_endpoint},
+    {"transfer_get_type", lusb_transfer_get_type},
+    {"transfer_is_active", lusb_transfer_is_active},
+    {"transfer_get_times", lusb_transfer_get_times},
     {"transfer_get_data", lusb_transfer_get_data},
     {"control_transfer_get_data", lusb_control_transfer_get_data},
     {"control_transfer_get_setup", lusb_control_transfer_get_setup},
+    {"transfer_get_view", lusb_transfer_get_view},
+    {"control_transfer_get_view", lusb_control_transfer_get_view},
     {"fill_control_setup", lusb_fill_control_setup},
     {"fill_control_transfer", lusb_fill_control_transfer},
     {"fill_bulk_transfer", lusb_fill_bulk_transfer},
     {"fill_interrupt_transfer", lusb_fill_interrupt_transfer},
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000103)
+    {"fill_bulk_stream_transfer", lusb_fill_bulk_stream_transfer},
+    {"transfer_get_stream_id", lusb_transfer_get_stream_id},
+    {"transfer_set_stream_id", lusb_transfer_set_stream_id},
+#endif
     {"fill_iso_transfer", lusb_fill_iso_transfer},
     {"set_iso_packet_lengths", lusb_set_iso_packet_lengths},
     {"get_iso_packet_buffer", lusb_get_iso_packet_buffer},
+    {"get_iso_packet_view", lusb_get_iso_packet_view},
+    {"get_iso_packets", lusb_get_iso_packets},
+    {"set_iso_packets", lusb_set_iso_packets},
     {"set_iso_packet_buffer", lusb_set_iso_packet_buffer},
     {NULL, NULL}
 };
 
+static const luaL_Reg lusb_devdesc_methods[] = {
+    {NULL, NULL}
+};
+
+static const luaL_Reg lusb_configdesc_methods[] = {
+    {"interface", lusb_config_desc_interface},
+    {"interfaces", lusb_config_desc_interfaces},
+    {"num_altsetting", lusb_config_desc_num_altsetting},
+    {NULL, NULL}
+};
+
+static const luaL_Reg lusb_ifacedesc_methods[] = {
+    {"endpoint", lusb_interface_desc_endpoint},
+    {"endpoints", lusb_interface_desc_endpoints},
+    {NULL, NULL}
+};
+
+static const luaL_Reg lusb_endpdesc_methods[] = {
+    {NULL, NULL}
+};
+
+static const luaL_Reg lusb_stream_methods[] = {
+    {"read", lusb_stream_read},
+    {"pending", lusb_stream_pending},
+    {"close", lusb_stream_close},
+    {NULL, NULL}
+};
+
+static const luaL_Reg lusb_buffer_methods[] = {
+    {"len", lusb_buffer_len},
+    {"byte", lusb_buffer_byte},
+    {"setbyte", lusb_buffer_setbyte},
+    {"write", lusb_buffer_write},
+    {"sub", lusb_buffer_sub},
+    {"tostring", lusb_buffer_tostring},
+    {NULL, NULL}
+};
+
 static const luaL_Reg lusb_functions[] = {
     {"init", lusb_init},
     {"set_debug", lusb_set_debug},
     {"get_device_list", lusb_get_device_list},
+    {"get_device_changes", lusb_get_device_changes},
+    {"find_devices", lusb_find_devices},
+    {"open_devices", lusb_open_devices},
     {"get_bus_number", lusb_get_bus_number},
     {"get_device_address", lusb_get_device_address},
     {"get_max_packet_size", lusb_get_max_packet_size},
@@ -2179,10 +6153,18 @@ static const luaL_Reg lusb_functions[] = {
     {"get_active_config_descriptor", lusb_get_active_config_descriptor},
     {"get_config_descriptor", lusb_get_config_descriptor},
     {"get_config_descriptor_by_value", lusb_get_config_descriptor_by_value},
+    {"get_device_descriptor_proxy", lusb_get_device_descriptor_proxy},
+    {"get_active_config_descriptor_proxy", lusb_get_active_config_descriptor_proxy},
+    {"get_config_descriptor_proxy", lusb_get_config_descriptor_proxy},
+    {"get_config_descriptor_by_value_proxy", lusb_get_config_descriptor_by_value_proxy},
     {"get_descriptor", lusb_get_descriptor},
     {"get_string_descriptor", lusb_get_string_descriptor},
     {"get_string_descriptor_ascii", lusb_get_string_descriptor_ascii},
     {"get_string_descriptor_utf8", lusb_get_string_descriptor_utf8},
+    {"get_strings", lusb_get_strings},
+    {"handle_stats", lusb_handle_stats},
+    {"latency_stats", lusb_latency_stats},
+    {"reset_latency_stats", lusb_reset_latency_stats},
     {"close", closehandle},
     {"open", lusb_open},
     {"open_device_with_vid_pid", lusb_open_device_with_vid_pid},
@@ -2200,19 +6182,53 @@ static const luaL_Reg lusb_functions[] = {
     {"control_transfer", lusb_control_transfer},
     {"bulk_transfer", lusb_bulk_transfer},
     {"interrupt_transfer", lusb_interrupt_transfer},
+    {"bulk_transfer_buffer", lusb_bulk_transfer_buffer},
+    {"interrupt_transfer_buffer", lusb_interrupt_transfer_buffer},
+    {"dev_mem_alloc", lusb_dev_mem_alloc},
+    {"stream", lusb_stream},
+    {"iso_stream", lusb_iso_stream},
+    {"read_async", lusb_read_async},
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000103)
+    {"alloc_streams", lusb_alloc_streams},
+    {"free_streams", lusb_free_streams},
+#endif
     {"transfer", lusb_transfer},
+    {"buffer", lusb_buffer},
     {"submit_transfer", lusb_submit_transfer},
+    {"resubmit_transfer", lusb_resubmit_transfer},
     {"cancel_transfer", lusb_cancel_transfer},
+    {"await", lusb_transfer_await},
+    {"set_reuse_buffer", lusb_set_reuse_buffer},
+    {"set_native_buffer", lusb_set_native_buffer},
+    {"set_flags", lusb_set_flags},
+    {"get_flags", lusb_get_flags},
+    {"transfer_get_status", lusb_transfer_get_status},
+    {"transfer_get_actual_length", lusb_transfer_get_actual_length},
+    {"transfer_get_length", lusb_transfer_get_length},
+    {"transfer_get_endpoint", lusb_transfer_get_endpoint},
+    {"transfer_get_type", lusb_transfer_get_type},
+    {"transfer_is_active", lusb_transfer_is_active},
+    {"transfer_get_times", lusb_transfer_get_times},
     {"transfer_get_data", lusb_transfer_get_data},
     {"control_transfer_get_data", lusb_control_transfer_get_data},
     {"control_transfer_get_setup", lusb_control_transfer_get_setup},
+    {"transfer_get_view", lusb_transfer_get_view},
+    {"control_transfer_get_view", lusb_control_transfer_get_view},
     {"fill_control_setup", lusb_fill_control_setup},
     {"fill_control_transfer", lusb_fill_control_transfer},
     {"fill_bulk_transfer", lusb_fill_bulk_transfer},
     {"fill_interrupt_transfer", lusb_fill_interrupt_transfer},
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000103)
+    {"fill_bulk_stream_transfer", lusb_fill_bulk_stream_transfer},
+    {"transfer_get_stream_id", lusb_transfer_get_stream_id},
+    {"transfer_set_stream_id", lusb_transfer_set_stream_id},
+#endif
     {"fill_iso_transfer", lusb_fill_iso_transfer},
     {"set_iso_packet_lengths", lusb_set_iso_packet_lengths},
     {"get_iso_packet_buffer", lusb_get_iso_packet_buffer},
+    {"get_iso_packet_view", lusb_get_iso_packet_view},
+    {"get_iso_packets", lusb_get_iso_packets},
+    {"set_iso_packets", lusb_set_iso_packets},
     {"set_iso_packet_buffer", lusb_set_iso_packet_buffer},
     {"lock_events", lusb_lock_events},
     {"unlock_events", lusb_unlock_events},
@@ -2228,6 +6244,18 @@ static const luaL_Reg lusb_functions[] = {
     {"get_next_timeout", lusb_get_next_timeout},
     {"get_pollfds", lusb_get_pollfds},
     {"set_pollfd_notifiers", lusb_set_pollfd_notifiers},
+    {"start_event_thread", lusb_start_event_thread},
+    {"stop_event_thread", lusb_stop_event_thread},
+    {"poll_completions", lusb_poll_completions},
+    {"get_event_fd", lusb_get_event_fd},
+    {"dispatch", lusb_dispatch},
+    {"prefetch_strings", lusb_prefetch_strings},
+    {"stats", lusb_ctx_stats},
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000102)
+    {"hotplug_register", lusb_hotplug_register},
+    {"hotplug_deregister", lusb_hotplug_deregister},
+    {"attached_devices", lusb_attached_devices},
+#endif
     {NULL, NULL}
 };
 
@@ -2321,6 +6349,12 @@ static const l_constant lusb_constants[] = {
     constant(LIBUSB_TRANSFER_NO_DEVICE),
     constant(LIBUSB_TRANSFER_OVERFLOW),
     constant(LIBUSB_TRANSFER_SHORT_NOT_OK),
+    constant(LIBUSB_TRANSFER_ADD_ZERO_PACKET),
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000102)
+    constant(LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED),
+    constant(LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT),
+    constant(LIBUSB_HOTPLUG_MATCH_ANY),
+#endif
     /* Lua clients should not be concerned with this
     constant(LIBUSB_TRANSFER_FREE_BUFFER),
     constant(LIBUSB_TRANSFER_FREE_TRANSFER),
@@ -2350,27 +6384,79 @@ static void reg_methods_n(lua_State *L, const char *name,
 	lua_createtable(L, 0, nfuncs);
 	luaL_setfuncs(L, funcs, 0);
 	lua_setfield(L, -2, "__index");
-	lua_pushcfunction(L, gc);
-	lua_setfield(L, -2, "__gc");
+	if (gc != NULL)
+	{
+	    lua_pushcfunction(L, gc);
+	    lua_setfield(L, -2, "__gc");
+	}
 	lua_pushboolean(L, 0);
 	lua_setfield(L, -2, "__metatable");
     }
     lua_pop(L, 1);
 }
 
+/* replace the methods table with a field lookup */
+static void reg_fields(lua_State *L, const char *name,
+		       const struct l_field *fields, lua_CFunction len)
+{
+    luaL_getmetatable(L, name);
+    lua_getfield(L, -1, "__index");
+    lua_pushlightuserdata(L, (void*)fields);
+    lua_pushcclosure(L, descindex, 2);
+    lua_setfield(L, -2, "__index");
+    if (len != NULL)
+    {
+	lua_pushcfunction(L, len);
+	lua_setfield(L, -2, "__len");
+    }
+    lua_pop(L, 1);
+}
+
 int luaopen_libusb1(lua_State *L)
 {
     int i;
+#if LUA_VERSION_NUM<502
+    if (lua_pushthread(L))
+	lua_setfield(L, LUA_REGISTRYINDEX, MAINTHREAD_REG);
+    else
+	lua_pop(L, 1);
+#endif
     reg_table(L, DEVICES_REG, "kv");
     reg_table(L, DEVPTR_REG, "v");
     reg_table(L, HANDLES_REG, "k");
     reg_table(L, BUFFER_REG, "k");
+    reg_table(L, CALLBACK_REG, "k");
     reg_table(L, TRANSFER_REG, NULL);
     reg_table(L, POLLFD_REG, "k");
+    reg_table(L, VIEWS_REG, "k");
+    reg_table(L, HOTPLUG_REG, NULL);
+    reg_table(L, CONTEXTS_REG, "v");
+    reg_table(L, ATTACHED_REG, "k");
+    reg_table(L, CHANGES_REG, "k");
+    reg_table(L, DESC_REG, "k");
+    reg_table(L, DESCOWNER_REG, "k");
+    reg_table(L, STRINGS_REG, "k");
     reg_methods(L, CONTEXT_MT, lusb_ctx_methods, exitctx);
     reg_methods(L, DEVICE_MT, lusb_dev_methods, unrefdev);
     reg_methods(L, HANDLE_MT, lusb_handle_methods, closehandle);
     reg_methods(L, TRANSFER_MT, lusb_transfer_methods, freetransfer);
+    reg_methods(L, BUFFER_MT, lusb_buffer_methods, freebuffer);
+    reg_methods(L, STREAM_MT, lusb_stream_methods, closestream);
+    /* only the config descriptor proxy owns libusb memory */
+    reg_methods(L, DEVDESC_MT, lusb_devdesc_methods, NULL);
+    reg_methods(L, CONFIGDESC_MT, lusb_configdesc_methods, freeconfigdesc);
+    reg_methods(L, IFACEDESC_MT, lusb_ifacedesc_methods, NULL);
+    reg_methods(L, ENDPDESC_MT, lusb_endpdesc_methods, NULL);
+    reg_fields(L, DEVDESC_MT, lusb_device_fields, NULL);
+    reg_fields(L, CONFIGDESC_MT, lusb_config_fields, lusb_config_desc_len);
+    reg_fields(L, IFACEDESC_MT, lusb_interface_fields, lusb_interface_desc_len);
+    reg_fields(L, ENDPDESC_MT, lusb_endpoint_fields, NULL);
+    luaL_getmetatable(L, BUFFER_MT);
+    lua_pushcfunction(L, lusb_buffer_len);
+    lua_setfield(L, -2, "__len");
+    lua_pushcfunction(L, lusb_buffer_tostring);
+    lua_setfield(L, -2, "__tostring");
+    lua_pop(L, 1);
     lua_createtable(L, 0, (sizeof(lusb_functions)/sizeof(luaL_Reg))+
 	    		   (sizeof(lusb_constants)/sizeof(l_constant))-2);
     luaL_setfuncs(L, lusb_functions, 0);
@@ -25,3 +25,87 @@ for i=1,#devices do
     end
 end
 
+
+-- byte buffers and views
+local b = usb.buffer("abcd")
+assert(b:len() == 4 and #b == 4 and b:tostring() == "abcd")
+assert(usb.buffer("1234"):tostring() == "1234")
+assert(usb.buffer(3):tostring() == "\0\0\0")
+assert(select('#', b:byte(1, -1)) == 4 and b:byte(2) == 98)
+b:setbyte(1, 65, 66)
+assert(b:tostring() == "ABcd")
+b:write(-1, "xyz")
+assert(b:tostring() == "ABcx")
+local v = b:sub(2, 3)
+assert(#v == 2 and v:tostring() == "Bc")
+v:write(1, "QR")
+assert(b:tostring() == "AQRx" and b:tostring(2, 3) == "QR")
+print("buffers ok")
+
+-- descriptor caches and proxies
+for i=1,#devices do
+    local dev = devices[i]
+    local d = assert(dev:get_device_descriptor())
+    local p = assert(dev:get_device_descriptor_proxy())
+    assert(p.idVendor == d.idVendor and p.idProduct == d.idProduct)
+    assert(p.bNumConfigurations == d.bNumConfigurations)
+    -- every call gets its own copy of the cached table
+    d.idVendor = -1
+    assert(dev:get_device_descriptor().idVendor == p.idVendor)
+    local c = dev:get_config_descriptor(0)
+    local cp = dev:get_config_descriptor_proxy(0)
+    if c and cp then
+	assert(#cp == c.bNumInterfaces and cp.wTotalLength == c.wTotalLength)
+	for iface, n, alt in cp:interfaces() do
+	    local e = c.interface[n][alt]
+	    assert(iface.bInterfaceNumber == e.bInterfaceNumber)
+	    assert(#iface == e.bNumEndpoints)
+	    for ep, k in iface:endpoints() do
+		assert(ep.bEndpointAddress == e.endpoint[k].bEndpointAddress)
+		assert(ep.bRefresh == e.endpoint[k].bRefresh)
+	    end
+	end
+    end
+end
+print("descriptors ok")
+
+-- filters and incremental enumeration
+local all = assert(usb.find_devices({}))
+assert(#all == #devices)
+if #devices > 0 then
+    local vid = usb.get_device_descriptor(devices[1]).idVendor
+    for _,dev in ipairs(assert(usb.find_devices({vendor_id=vid}))) do
+	assert(usb.get_device_descriptor(dev).idVendor == vid)
+    end
+end
+local added, removed, token = assert(usb.get_device_changes())
+assert(#added == #devices and #removed == 0)
+added, removed = assert(usb.get_device_changes(token))
+print("device changes", #added, #removed)
+print("find_devices ok")
+
+-- event thread and completion queue
+local ctx = assert(usb.init())
+assert(ctx:start_event_thread())
+assert(ctx:poll_completions() == 0)
+assert(ctx:dispatch() == 0)
+assert(type(ctx:get_event_fd()) == "number")
+ctx:stop_event_thread()
+assert(ctx:dispatch() == 0)
+print("event thread ok")
+
+-- counters
+local s = assert(usb.stats())
+assert(s.completed and s.errors and s.bytes_in and s.bytes_out)
+for i=1,#devices do
+    local h = usb.open(devices[i])
+    if h then
+	assert(h:stats().endpoints)
+	assert(next(h:latency_stats()) == nil)
+	assert(h:latency_stats(0x81).count == 0)
+	h:reset_latency_stats()
+	h:close()
+	break
+    end
+end
+print("stats ok")